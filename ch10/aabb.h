@@ -9,20 +9,27 @@ public:
 	point3 min() const { return _min; }
 	point3 max() const { return _max; }
 
-	bool hit(const ray& r, double tmin, double tmax) const
+	// Slab test on the ray's precomputed reciprocal direction and signs, so it
+	// needs no divisions or branches. A component of (bound - origin) * inv_dir
+	// is NaN only when the ray lies exactly in a slab plane; `a > b ? a : b`
+	// then keeps the running interval, treating the ray as inside that slab.
+	bool hit(const ray& r, real tmin, real tmax) const
 	{
+		const point3* bounds[2] = { &_min, &_max };
 		for (int a = 0; a < 3; a++)
 		{
-			auto t0 = fmin((_min[a] - r.origin()[a]) / r.direction()[a], 
-						   (_max[a] - r.origin()[a]) / r.direction()[a]);
-			auto t1 = fmax((_min[a] - r.origin()[a]) / r.direction()[a], 
-						   (_max[a] - r.origin()[a]) / r.direction()[a]);
-			tmin = fmax(t0, tmin);
-			tmax = fmin(t1, tmax);
-			if (tmax <= tmin)
-				return false;
+			auto t0 = ((*bounds[r.sign[a]])[a] - r.orig[a]) * r.inv_dir[a];
+			auto t1 = ((*bounds[1 - r.sign[a]])[a] - r.orig[a]) * r.inv_dir[a];
+			tmin = t0 > tmin ? t0 : tmin;
+			tmax = t1 < tmax ? t1 : tmax;
 		}
-		return true;
+		return tmin < tmax;
+	}
+
+	real surface_area() const
+	{
+		auto d = _max - _min;
+		return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
 	}
 
 	point3 _min;
@@ -1,16 +1,104 @@
 #pragma once
 #include "hittable.h"
+#include "material.h"
+
+// Packet form of the rects' hit() below, the plane being axis K at k and the
+// rect spanning [a0, a1] x [b0, b1] on axes A and B: the same arithmetic and
+// comparisons per lane, so each lane finds the t hit() would.
+template <int A, int B, int K>
+int rect_hit_packet(real a0, real a1, real b0, real b1, real k, ray_packet& p, int mask)
+{
+	alignas(32) real lanes[ray_packet::width];
+	ray_packet::unpack(mask, lanes);
+	for (int i = 0; i < ray_packet::width; i++)
+	{
+		auto t = (k - p.o[K][i]) * p.inv[K][i];
+		auto a = p.o[A][i] + t * p.d[A][i];
+		auto b = p.o[B][i] + t * p.d[B][i];
+		// Non-short-circuit ors keep the loop free of branches.
+		bool out = (t < p.t_min) | (t > p.t_max[i]) | (a < a0) | (a > a1) | (b < b0) | (b > b1);
+		bool hit = !out & (lanes[i] != 0);
+		p.t_max[i] = hit ? t : p.t_max[i];
+		lanes[i] = hit ? 1 : 0;
+	}
+	return ray_packet::pack(lanes);
+}
+
+// Occlusion test for the rects below: the plane crossing alone.
+template <int A, int B, int K>
+bool rect_occluded(real a0, real a1, real b0, real b1, real k, const ray& r, real t0, real t1)
+{
+	auto t = (k - r.orig[K]) * r.inv_dir[K];
+	if (t < t0 || t > t1)
+		return false;
+	auto a = r.orig[A] + t * r.dir[A];
+	auto b = r.orig[B] + t * r.dir[B];
+	// Same comparisons as hit(), so the two agree even on NaNs.
+	return !(a < a0 || a > a1 || b < b0 || b > b1);
+}
+
+// Light sampling for the rects below: a uniform point of the rect, picked
+// from o with solid-angle density distance^2 / (cosine * area).
+template <int A, int B, int K>
+vec3 rect_random(real a0, real a1, real b0, real b1, real k, const point3& o)
+{
+	point3 p;
+	p[A] = random_double(a0, a1);
+	p[B] = random_double(b0, b1);
+	p[K] = k;
+	return p - o;
+}
+
+template <int K>
+real rect_pdf_value(const hittable& rect, real area, const point3& o, const vec3& v)
+{
+	hit_record rec;
+	if (!rect.hit(ray(o, v), 0.001, infinity, rec))
+		return 0;
+	auto distance_squared = rec.t * rec.t * v.length_squared();
+	auto cosine = fabs(v[K]) / v.length();
+	return distance_squared / (cosine * area);
+}
 
 class xy_rect : public hittable
 {
 public:
 	xy_rect() {}
-	xy_rect(double _x0, double _x1, double _y0, double _y1, double _k, shared_ptr<material> mat) :
+	xy_rect(real _x0, real _x1, real _y0, real _y1, real _k, shared_ptr<material> mat) :
 		x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
-	virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+	virtual bool hit(const ray& r, real t0, real t1, hit_record& rec) const;
+	virtual bool hit_deferred(const ray& r, real t0, real t1, hit_record& rec) const
+	{
+		if (!xy_rect::hit(r, t0, t1, rec))
+			return false;
+		rec.object = nullptr;
+		return true;
+	}
+	virtual int hit_packet(ray_packet& p, int mask, packet_hits& hits) const
+	{
+		return hits.lowered_by(this, rect_hit_packet<0, 1, 2>(x0, x1, y0, y1, k, p, mask));
+	}
+	virtual bool traces_packets() const { return true; }
+	virtual bool occluded(const ray& r, real t0, real t1) const
+	{
+		return rect_occluded<0, 1, 2>(x0, x1, y0, y1, k, r, t0, t1);
+	}
+	virtual real pdf_value(const point3& o, const vec3& v) const
+	{
+		return rect_pdf_value<2>(*this, (x1 - x0) * (y1 - y0), o, v);
+	}
+	virtual vec3 random(const point3& o) const
+	{
+		return rect_random<0, 1, 2>(x0, x1, y0, y1, k, o);
+	}
+	virtual void collect_lights(light_collection& out) const
+	{
+		if (mp->type == material_type::diffuse_light)
+			out.lights.push_back(this);
+	}
 
-	virtual bool bounding_box(double t0, double t1, aabb& output_box) const
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const
 	{
 		output_box = aabb(point3(x0, y0, k - 0.0001), point3(x1, y1, k + 0.0001));
 		return true;
@@ -18,18 +106,49 @@ public:
 
 public:
 	shared_ptr<material> mp;
-	double x0, x1, y0, y1, k;
+	real x0, x1, y0, y1, k;
 };
 
+template <> struct arena_allocatable<xy_rect> : std::true_type {};
+
 class xz_rect : public hittable
 {
 public:
 	xz_rect() {}
-	xz_rect(double _x0, double _x1, double _z0, double _z1, double _k, shared_ptr<material> mat) :
+	xz_rect(real _x0, real _x1, real _z0, real _z1, real _k, shared_ptr<material> mat) :
 		x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {}
 
-	virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
-	virtual bool bounding_box(double t0, double t1, aabb& output_box) const
+	virtual bool hit(const ray& r, real t0, real t1, hit_record& rec) const;
+	virtual bool hit_deferred(const ray& r, real t0, real t1, hit_record& rec) const
+	{
+		if (!xz_rect::hit(r, t0, t1, rec))
+			return false;
+		rec.object = nullptr;
+		return true;
+	}
+	virtual int hit_packet(ray_packet& p, int mask, packet_hits& hits) const
+	{
+		return hits.lowered_by(this, rect_hit_packet<0, 2, 1>(x0, x1, z0, z1, k, p, mask));
+	}
+	virtual bool traces_packets() const { return true; }
+	virtual bool occluded(const ray& r, real t0, real t1) const
+	{
+		return rect_occluded<0, 2, 1>(x0, x1, z0, z1, k, r, t0, t1);
+	}
+	virtual real pdf_value(const point3& o, const vec3& v) const
+	{
+		return rect_pdf_value<1>(*this, (x1 - x0) * (z1 - z0), o, v);
+	}
+	virtual vec3 random(const point3& o) const
+	{
+		return rect_random<0, 2, 1>(x0, x1, z0, z1, k, o);
+	}
+	virtual void collect_lights(light_collection& out) const
+	{
+		if (mp->type == material_type::diffuse_light)
+			out.lights.push_back(this);
+	}
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const
 	{
 		output_box = aabb(point3(x0, k - 0.0001, z0), point3(x1, k + 0.0001, z1));
 		return true;
@@ -37,18 +156,49 @@ public:
 
 public:
 	shared_ptr<material> mp;
-	double x0, x1, z0, z1, k;
+	real x0, x1, z0, z1, k;
 };
 
+template <> struct arena_allocatable<xz_rect> : std::true_type {};
+
 class yz_rect : public hittable
 {
 public:
 	yz_rect() {}
-	yz_rect(double _y0, double _y1, double _z0, double _z1, double _k, shared_ptr<material> mat) :
+	yz_rect(real _y0, real _y1, real _z0, real _z1, real _k, shared_ptr<material> mat) :
 		y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {}
 
-	virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
-	virtual bool bounding_box(double t0, double t1, aabb& output_box) const
+	virtual bool hit(const ray& r, real t0, real t1, hit_record& rec) const;
+	virtual bool hit_deferred(const ray& r, real t0, real t1, hit_record& rec) const
+	{
+		if (!yz_rect::hit(r, t0, t1, rec))
+			return false;
+		rec.object = nullptr;
+		return true;
+	}
+	virtual int hit_packet(ray_packet& p, int mask, packet_hits& hits) const
+	{
+		return hits.lowered_by(this, rect_hit_packet<1, 2, 0>(y0, y1, z0, z1, k, p, mask));
+	}
+	virtual bool traces_packets() const { return true; }
+	virtual bool occluded(const ray& r, real t0, real t1) const
+	{
+		return rect_occluded<1, 2, 0>(y0, y1, z0, z1, k, r, t0, t1);
+	}
+	virtual real pdf_value(const point3& o, const vec3& v) const
+	{
+		return rect_pdf_value<0>(*this, (y1 - y0) * (z1 - z0), o, v);
+	}
+	virtual vec3 random(const point3& o) const
+	{
+		return rect_random<1, 2, 0>(y0, y1, z0, z1, k, o);
+	}
+	virtual void collect_lights(light_collection& out) const
+	{
+		if (mp->type == material_type::diffuse_light)
+			out.lights.push_back(this);
+	}
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const
 	{
 		output_box = aabb(point3(k - 0.0001, y0, z0), point3(k + 0.0001, y1, z1));
 		return true;
@@ -56,12 +206,14 @@ public:
 
 public:
 	shared_ptr<material> mp;
-	double y0, y1, z0, z1, k;
+	real y0, y1, z0, z1, k;
 };
 
-bool xy_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const
+template <> struct arena_allocatable<yz_rect> : std::true_type {};
+
+bool xy_rect::hit(const ray& r, real t0, real t1, hit_record& rec) const
 {
-	auto t = (k - r.origin().z()) / r.direction().z();
+	auto t = (k - r.origin().z()) * r.inv_dir.z();
 	if (t<t0 || t>t1)
 		return false;
 
@@ -71,17 +223,18 @@ bool xy_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const
 		return false;
 	rec.u = (x - x0) / (x1 - x0);
 	rec.v = (y - y0) / (y1 - y0);
+	rec.uv_scale = 0;
 	rec.t = t;
 	auto outward_normal = vec3(0, 0, 1);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mp;
+	rec.mat_ptr = mp.get();
 	rec.p = r.at(t);
 	return true;
 }
 
-bool xz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const
+bool xz_rect::hit(const ray& r, real t0, real t1, hit_record& rec) const
 {
-	auto t = (k - r.origin().y()) / r.direction().y();
+	auto t = (k - r.origin().y()) * r.inv_dir.y();
 	if (t<t0 || t>t1)
 		return false;
 	auto x = r.origin().x() + t * r.direction().x();
@@ -90,17 +243,18 @@ bool xz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const
 		return false;
 	rec.u = (x - x0) / (x1 - x0);
 	rec.v = (z - z0) / (z1 - z0);
+	rec.uv_scale = 0;
 	rec.t = t;
 	auto outward_normal = vec3(0, 1, 0);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mp;
+	rec.mat_ptr = mp.get();
 	rec.p = r.at(t);
 	return true;
 }
 
-bool yz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const
+bool yz_rect::hit(const ray& r, real t0, real t1, hit_record& rec) const
 {
-	auto t = (k - r.origin().x()) / r.direction().x();
+	auto t = (k - r.origin().x()) * r.inv_dir.x();
 	if (t<t0 || t>t1)
 		return false;
 	auto y = r.origin().y() + t * r.direction().y();
@@ -109,10 +263,11 @@ bool yz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const
 		return false;
 	rec.u = (y - y0) / (y1 - y0);
 	rec.v = (z - z0) / (z1 - z0);
+	rec.uv_scale = 0;
 	rec.t = t;
 	auto outward_normal = vec3(1, 0, 0);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mp;
+	rec.mat_ptr = mp.get();
 	rec.p = r.at(t);
 	return true;
 }
\ No newline at end of file
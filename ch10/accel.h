@@ -0,0 +1,38 @@
+#pragma once
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "bvh4.h"
+
+// Acceleration structures a scene can be compiled into.
+enum class accel_type
+{
+	bvh_node,	// binary tree of shared_ptr nodes, one virtual call per level
+	linear_bvh,	// flattened binary tree, 32-byte nodes
+	bvh4		// 4-wide tree with SIMD slab tests
+};
+
+inline const char* accel_name(accel_type type)
+{
+	switch (type)
+	{
+	case accel_type::bvh_node: return "bvh_node";
+	case accel_type::linear_bvh: return "linear_bvh";
+	case accel_type::bvh4: return "bvh4";
+	}
+	return "?";
+}
+
+// Turns a built bvh_node tree into the requested traversal structure.
+inline shared_ptr<hittable> make_accel(const shared_ptr<bvh_node>& root,
+	real time0, real time1, accel_type type, scene_arena* arena = nullptr)
+{
+	switch (type)
+	{
+	case accel_type::linear_bvh:
+		return make_shared_in<linear_bvh>(arena, *root, time0, time1);
+	case accel_type::bvh4:
+		return make_shared_in<bvh4>(arena, linear_bvh(*root, time0, time1));
+	default:
+		return root;
+	}
+}
@@ -0,0 +1,202 @@
+#pragma once
+#include "rtweekend.h"
+#include "stb_image_write.h"
+#include <cstdint>
+#include <vector>
+
+#include "scheduler.h"
+
+// Per-pixel sample budget for adaptive sampling. Every pixel takes min_spp
+// samples, then unconverged pixels get batch more at a time until the 95%
+// confidence interval of the mean luminance is narrower than max_error times
+// the mean (with a floor so black pixels converge), or max_spp is reached.
+struct adaptive_settings
+{
+	int min_spp = 64;
+	int max_spp = 1000;
+	int batch = 16;
+	double max_error = 0.05;
+	double luminance_floor = 1.0 / 256;
+};
+
+// Running mean and variance of a pixel's samples (Welford's algorithm),
+// tracked on luminance next to the plain color sum.
+class pixel_estimator
+{
+public:
+	void add(const color& c)
+	{
+		sum += c;
+		n++;
+		auto y = luminance(c);
+		auto delta = y - mean;
+		mean += delta / n;
+		m2 += delta * (y - mean);
+	}
+
+	// Folds another estimator's samples into this one (Chan et al.).
+	void merge(const pixel_estimator& o)
+	{
+		if (o.n == 0)
+			return;
+		auto total = n + o.n;
+		auto delta = o.mean - mean;
+		m2 += o.m2 + delta * delta * (double(n) * o.n / total);
+		mean += delta * o.n / total;
+		sum += o.sum;
+		n = total;
+	}
+
+	// Everything the estimator holds, as plain data for checkpoints.
+	struct state
+	{
+		real sum[3];
+		int32_t n;
+		double mean;
+		double m2;
+	};
+
+	state save() const { return { { sum.x(), sum.y(), sum.z() }, n, mean, m2 }; }
+	void restore(const state& s)
+	{
+		sum = color(s.sum[0], s.sum[1], s.sum[2]);
+		n = s.n;
+		mean = s.mean;
+		m2 = s.m2;
+	}
+
+	int count() const { return n; }
+	color total() const { return sum; }
+	double variance() const { return n > 1 ? m2 / (n - 1) : 0.0; }
+
+	bool converged(const adaptive_settings& settings) const
+	{
+		if (n < settings.min_spp)
+			return false;
+		auto half_width = 1.96 * sqrt(variance() / n);
+		return half_width <= settings.max_error * fmax(mean, settings.luminance_floor);
+	}
+
+	static double luminance(const color& c)
+	{
+		return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+	}
+
+private:
+	color sum;
+	int n = 0;
+	double mean = 0;
+	double m2 = 0;
+};
+
+// Samples [first, last) of the pixel in column x, row y, to be added to
+// *pixel in order.
+struct sample_span
+{
+	int x, y;
+	int first, last;
+	pixel_estimator* pixel;
+};
+
+// Samples every pixel of a tile in rounds, up to limit samples per pixel,
+// calling sample(spans) with every span of a round at once so the caller may
+// trace them together. pixels holds the estimators of area, row-major:
+// the whole image, or just the tile when only the tiles in flight keep
+// theirs. It keeps them between calls: a progressive render raises limit
+// and calls again for each pass. Returns the number of samples added.
+//
+// With adaptive off one round fills each pixel up to limit. Otherwise the
+// first round brings pixels to min_spp and later rounds give batch more to
+// unconverged pixels. Convergence is judged on the pooled samples of the
+// pixel's 3x3 neighbourhood inside the tile: a lone pixel that has not yet
+// seen a rare bright path would look converged and stop dark, its
+// neighbours rarely all miss them.
+template <class F>
+long long sample_tile(const tile& t, const adaptive_settings& settings, bool adaptive, int limit,
+	F sample, std::vector<pixel_estimator>& pixels, const tile& area)
+{
+	const int w = t.x1 - t.x0;
+	const int h = t.y1 - t.y0;
+	const int stride = area.x1 - area.x0;
+	limit = std::min(limit, settings.max_spp);
+	auto at = [&](int k) -> pixel_estimator& {
+		return pixels[(t.y0 - area.y0 + k / w) * stride + t.x0 - area.x0 + k % w];
+	};
+
+	long long added = 0;
+	std::vector<sample_span> spans;
+	auto take_to = [&](int k, int target) {
+		int first = at(k).count();
+		int last = std::min(target, limit);
+		if (first < last)
+		{
+			spans.push_back({ t.x0 + k % w, t.y0 + k / w, first, last, &at(k) });
+			added += last - first;
+		}
+	};
+	auto run_round = [&] {
+		if (!spans.empty())
+			sample(spans);
+		spans.clear();
+	};
+
+	std::vector<int> active;
+	for (int k = 0; k < w * h; k++)
+		take_to(k, adaptive ? settings.min_spp : limit);
+	run_round();
+	for (int k = 0; adaptive && k < w * h; k++)
+	{
+		if (at(k).count() < limit)
+			active.push_back(k);
+	}
+
+	while (!active.empty())
+	{
+		std::vector<int> still_active;
+		for (int k : active)
+		{
+			int x = k % w;
+			int y = k / w;
+			pixel_estimator window;
+			for (int dy = -1; dy <= 1; dy++)
+			{
+				for (int dx = -1; dx <= 1; dx++)
+				{
+					if (x + dx >= 0 && x + dx < w && y + dy >= 0 && y + dy < h)
+						window.merge(at((y + dy) * w + x + dx));
+				}
+			}
+			if (!window.converged(settings))
+				still_active.push_back(k);
+		}
+		for (int k : still_active)
+			take_to(k, at(k).count() + settings.batch);
+		run_round();
+
+		active.clear();
+		for (int k : still_active)
+		{
+			if (at(k).count() < limit)
+				active.push_back(k);
+		}
+	}
+	return added;
+}
+
+// Writes the samples each pixel used as a blue (min_spp) to red (max_spp)
+// image, for tuning the settings.
+void write_spp_heatmap(const char* filename, const std::vector<int>& spp,
+	int width, int height, const adaptive_settings& settings)
+{
+	std::vector<unsigned char> data(width * height * 3);
+	auto range = fmax(settings.max_spp - settings.min_spp, 1);
+	for (int p = 0; p < width * height; p++)
+	{
+		auto t = clamp((spp[p] - settings.min_spp) / range, 0.0, 1.0);
+		auto g = 1 - fabs(2 * t - 1);
+		data[p * 3] = static_cast<unsigned char>(255 * t);
+		data[p * 3 + 1] = static_cast<unsigned char>(255 * g);
+		data[p * 3 + 2] = static_cast<unsigned char>(255 * (1 - t));
+	}
+	stbi_write_jpg(filename, width, height, 3, data.data(), 100);
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using std::shared_ptr;
+using std::make_shared;
+
+// Types the arena may hold without running their destructor: trivially
+// destructible ones, and those declared so next to their definition because
+// their only members with a destructor are shared_ptrs into the arena,
+// whose destruction does nothing.
+template <class T>
+struct arena_allocatable : std::is_trivially_destructible<T> {};
+
+// Bump allocator that owns a whole scene: hittables, materials and textures
+// are packed back to back into a few large blocks instead of one heap
+// allocation (plus control block) each.
+//
+// make<T>() hands out shared_ptrs that alias an empty owner, so they can be
+// passed to every existing constructor but carry no reference count at all:
+// copying them is free, and the objects live exactly as long as the arena.
+//
+// No destructor ever runs: the arena only takes types that are
+// arena_allocatable, and tearing it down just frees its blocks, however many
+// objects they hold. Every pointer into the arena, including those held by
+// heap objects such as a linear_bvh's primitives, dangles once it is gone, so
+// the arena must outlive the scene and everything that renders it.
+class scene_arena
+{
+public:
+	explicit scene_arena(size_t block_size = 1 << 20) : block_size(block_size) {}
+	scene_arena(const scene_arena&) = delete;
+	scene_arena& operator=(const scene_arena&) = delete;
+
+	// Every shared_ptr among args must come from this arena (or be null),
+	// since T's destructor would be the only thing releasing it.
+	template <class T, class... Args>
+	shared_ptr<T> make(Args&&... args)
+	{
+		static_assert(arena_allocatable<T>::value, "the arena never destroys what it holds");
+		void* p = allocate(sizeof(T), alignof(T));
+		T* object = new (p) T(std::forward<Args>(args)...);
+		return shared_ptr<T>(shared_ptr<void>(), object);
+	}
+
+	size_t bytes_used() const
+	{
+		size_t n = 0;
+		for (const auto& b : blocks)
+			n += b.used;
+		return n;
+	}
+
+	size_t block_count() const { return blocks.size(); }
+
+private:
+	struct block
+	{
+		std::unique_ptr<unsigned char[]> data;
+		size_t size;
+		size_t used;
+	};
+
+	void* allocate(size_t size, size_t align)
+	{
+		if (!blocks.empty())
+		{
+			auto& b = blocks.back();
+			// Align the address rather than the offset: new[] only promises
+			// 16 bytes, and a SIMD vec3 in a double build needs 32.
+			auto base = reinterpret_cast<uintptr_t>(b.data.get());
+			size_t offset = ((base + b.used + align - 1) & ~uintptr_t(align - 1)) - base;
+			if (offset + size <= b.size)
+			{
+				b.used = offset + size;
+				return b.data.get() + offset;
+			}
+		}
+		// Room for the object plus worst-case alignment padding.
+		size_t n = size + align > block_size ? size + align : block_size;
+		blocks.push_back({ std::unique_ptr<unsigned char[]>(new unsigned char[n]), n, 0 });
+		return allocate(size, align);
+	}
+
+	size_t block_size;
+	std::vector<block> blocks;
+};
+
+// Whether an argument of make_shared_in holds nothing outside an arena. A
+// pointer from scene_arena::make has no owner; one from make_shared does.
+// Types holding shared_ptrs overload this next to their definition.
+template <class T>
+bool arena_held(const shared_ptr<T>& p) { return p.use_count() == 0; }
+
+template <class T>
+bool arena_held(const T&) { return true; }
+
+inline bool all_arena_held() { return true; }
+
+template <class T, class... Rest>
+bool all_arena_held(const T& first, const Rest&... rest)
+{
+	return arena_held(first) && all_arena_held(rest...);
+}
+
+template <class T, class... Args>
+shared_ptr<T> make_in_arena(scene_arena& arena, std::true_type, Args&&... args)
+{
+	return arena.make<T>(std::forward<Args>(args)...);
+}
+
+template <class T, class... Args>
+shared_ptr<T> make_in_arena(scene_arena&, std::false_type, Args&&... args)
+{
+	return make_shared<T>(std::forward<Args>(args)...);
+}
+
+// Allocates from the arena when one is given and falls back to make_shared,
+// so constructors can take an optional arena without two code paths. Types
+// the arena cannot hold, and objects that would keep heap objects alive,
+// go on the heap too; they may still point into the arena.
+template <class T, class... Args>
+shared_ptr<T> make_shared_in(scene_arena* arena, Args&&... args)
+{
+	if (arena && all_arena_held(args...))
+		return make_in_arena<T>(*arena, arena_allocatable<T>(), std::forward<Args>(args)...);
+	return make_shared<T>(std::forward<Args>(args)...);
+}
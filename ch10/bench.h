@@ -0,0 +1,460 @@
+#pragma once
+#include "rtweekend.h"
+#include "hittable_list.h"
+#include "camera.h"
+#include "accel.h"
+#include "material.h"
+#include "lights.h"
+#include "sphere.h"
+#include "texture.h"
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Micro-benchmarks, run with `mian --bench`. Each prints one line per case.
+
+inline double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Camera rays on a width x height grid, plus one diffuse bounce from every
+// camera ray that hits, traced against the scene built with each accel_type.
+inline void bench_accel(const std::function<hittable_list(accel_type)>& make_scene,
+	const camera& cam, int width, int height, int repeats = 3)
+{
+	const accel_type types[] = { accel_type::bvh_node, accel_type::linear_bvh, accel_type::bvh4 };
+
+	std::vector<ray> rays;
+	{
+		auto world = make_scene(accel_type::bvh_node);
+		for (int j = 0; j < height; ++j)
+		{
+			for (int i = 0; i < width; ++i)
+			{
+				seed_random(j * width + i);
+				ray r = cam.get_ray((i + random_double()) / (width - 1), (j + random_double()) / (height - 1));
+				rays.push_back(r);
+				hit_record rec;
+				if (world.hit(r, 0.001, infinity, rec))
+					rays.push_back(ray(rec.p, rec.normal + random_unit_vector(), r.time()));
+			}
+		}
+	}
+
+	std::cout << "accel: " << rays.size() << " rays, best of " << repeats << '\n';
+	for (auto type : types)
+	{
+		auto world = make_scene(type);
+		double best = infinity;
+		size_t hits = 0;
+		for (int k = 0; k < repeats; k++)
+		{
+			hits = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (size_t n = 0; n < rays.size(); n++)
+			{
+				// constant_medium draws random numbers; keep them the same per ray.
+				seed_random(n);
+				hit_record rec;
+				hits += world.hit(rays[n], 0.001, infinity, rec);
+			}
+			best = fmin(best, seconds_since(start));
+		}
+		std::cout << "  " << std::setw(10) << accel_name(type) << ": "
+				  << std::fixed << std::setprecision(2) << rays.size() / best * 1e-6 << " Mrays/s"
+				  << " (" << hits << " hits)\n";
+	}
+}
+
+// The record traffic of hittable_list::hit: a primitive writes its material
+// into a temporary record, which is then copied out. Compares the old owning
+// shared_ptr<material> record with hit_record's raw pointer, with every
+// thread sharing one material as the threads of a render do.
+inline void bench_hit_record(shared_ptr<material> shared, int threads, long long per_thread = 20000000)
+{
+	struct owning_hit_record
+	{
+		point3 p;
+		vec3 normal;
+		shared_ptr<material> mat_ptr;
+		double t, u, v;
+		bool front_face;
+	};
+
+	// Stores to a volatile keep the copies from being optimised away. Each
+	// thread has its own cache line to store to, so the threads share nothing
+	// but the material's reference count.
+	struct alignas(64) sink
+	{
+		const void* volatile last = nullptr;
+	};
+	std::vector<sink> sinks(threads);
+	bool kept = true;
+	auto run = [&](auto body) {
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> pool;
+		for (int k = 0; k < threads; k++)
+			pool.emplace_back(body, std::ref(sinks[k]));
+		for (auto& th : pool)
+			th.join();
+		auto rate = threads * per_thread / seconds_since(start) * 1e-6;
+		for (auto& s : sinks)
+			kept = kept && s.last == shared.get();
+		return rate;
+	};
+
+	auto owning = run([&](sink& out) {
+		owning_hit_record temp_rec, rec;
+		for (long long n = 0; n < per_thread; n++)
+		{
+			temp_rec.t = double(n);
+			temp_rec.mat_ptr = shared;
+			rec = temp_rec;
+			out.last = rec.mat_ptr.get();
+		}
+	});
+	auto raw = run([&](sink& out) {
+		hit_record temp_rec, rec;
+		for (long long n = 0; n < per_thread; n++)
+		{
+			temp_rec.t = double(n);
+			temp_rec.mat_ptr = shared.get();
+			rec = temp_rec;
+			out.last = rec.mat_ptr;
+		}
+	});
+
+	std::cout << "hit_record copies, " << threads << " threads:\n"
+			  << "  shared_ptr<material>: " << std::fixed << std::setprecision(1) << owning << " M/s\n"
+			  << "   const material*:    " << raw << " M/s\n";
+	if (!kept)
+		std::cout << "  (a thread's last record lost its material)\n";
+}
+
+// The slab test aabb::hit used before rays carried 1/dir: two divisions per
+// bound per axis and fmin/fmax. Kept here only as the benchmark baseline.
+inline bool legacy_aabb_hit(const aabb& box, const ray& r, double tmin, double tmax)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		auto t0 = fmin((box._min[a] - r.origin()[a]) / r.direction()[a],
+					   (box._max[a] - r.origin()[a]) / r.direction()[a]);
+		auto t1 = fmax((box._min[a] - r.origin()[a]) / r.direction()[a],
+					   (box._max[a] - r.origin()[a]) / r.direction()[a]);
+		tmin = fmax(t0, tmin);
+		tmax = fmin(t1, tmax);
+		if (tmax <= tmin)
+			return false;
+	}
+	return true;
+}
+
+// Box tests per second, old slab test against aabb::hit, on random boxes
+// and rays in a 100-unit cube. One ray in eight is axis-parallel, like the
+// rays that graze the xz_rect lights.
+inline void bench_aabb(int box_count = 1024, int ray_count = 4096)
+{
+	seed_random(11);
+	std::vector<aabb> boxes;
+	for (int k = 0; k < box_count; k++)
+	{
+		auto c = vec3::random(0, 100);
+		auto h = vec3::random(1, 10);
+		boxes.push_back(aabb(c - h, c + h));
+	}
+	std::vector<ray> rays;
+	for (int k = 0; k < ray_count; k++)
+	{
+		auto d = random_unit_vector();
+		if (k % 8 == 0)
+			d[k / 8 % 3] = 0;
+		rays.push_back(ray(vec3::random(0, 100), d));
+	}
+
+	auto run = [&](auto test) {
+		size_t hits = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (const auto& r : rays)
+			for (const auto& b : boxes)
+				hits += test(b, r);
+		auto rate = double(rays.size()) * boxes.size() / seconds_since(start) * 1e-6;
+		return std::make_pair(rate, hits);
+	};
+
+	auto before = run([](const aabb& b, const ray& r) { return legacy_aabb_hit(b, r, 0.001, infinity); });
+	auto after = run([](const aabb& b, const ray& r) { return b.hit(r, 0.001, infinity); });
+
+	std::cout << "aabb::hit, " << rays.size() * boxes.size() << " tests:\n"
+			  << "  divide + fmin/fmax: " << std::fixed << std::setprecision(1) << before.first << " M/s (" << before.second << " hits)\n"
+			  << "  inv_dir + signs:    " << after.first << " M/s (" << after.second << " hits)\n";
+}
+
+// Throughput of the vec3 operations the integrator leans on, for comparing
+// a scalar build with an RT_USE_SIMD one. Each case streams over the same
+// random vectors and folds its results into a sum the compiler must keep.
+inline void bench_vec3(int count = 4096, int repeats = 2000)
+{
+	seed_random(13);
+	std::vector<vec3> a, b;
+	for (int k = 0; k < count; k++)
+	{
+		a.push_back(vec3::random(-1, 1));
+		b.push_back(vec3::random(-1, 1));
+	}
+
+	static volatile real sink;
+	auto run = [&](const char* name, auto op) {
+		decltype(op(a[0], b[0])) acc{};
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < repeats; r++)
+			for (int k = 0; k < count; k++)
+				acc += op(a[k], b[k]);
+		auto rate = double(count) * repeats / seconds_since(start) * 1e-6;
+		sink = dot(vec3(1, 1, 1), vec3(1, 1, 1) * acc);
+		(void)sink;
+		std::cout << "  " << std::setw(11) << name << ": " << std::fixed << std::setprecision(1) << rate << " M/s\n";
+	};
+
+	std::cout << "vec3 (" << vec3_backend() << ", " << sizeof(vec3) << " bytes):\n";
+	run("add", [](const vec3& u, const vec3& v) { return u + v; });
+	run("sub", [](const vec3& u, const vec3& v) { return u - v; });
+	run("mul", [](const vec3& u, const vec3& v) { return u * v; });
+	run("scale", [](const vec3& u, const vec3& v) { return real(0.5) * u; });
+	run("dot", [](const vec3& u, const vec3& v) { return dot(u, v); });
+	run("cross", [](const vec3& u, const vec3& v) { return cross(u, v); });
+	run("length", [](const vec3& u, const vec3& v) { return u.length(); });
+	run("unit_vector", [](const vec3& u, const vec3& v) { return unit_vector(u); });
+}
+
+// Primary visibility: ray_packet::width jittered camera rays per pixel,
+// grouped as the renderer groups a pixel's samples, each traced alone and
+// then as one ray_packet, both giving full hit records. They must agree on
+// every hit.
+inline void bench_packets(const char* name, const hittable& world, const camera& cam,
+	int width, int height, int repeats = 3)
+{
+	const int n = ray_packet::width;
+	std::vector<ray> rays;
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			for (int s = 0; s < n; s++)
+			{
+				seed_random(y * width + x, s);
+				rays.push_back(cam.get_ray((x + random_double()) / (width - 1), (y + random_double()) / (height - 1)));
+			}
+		}
+	}
+
+	std::cout << "packets, " << name << ": " << rays.size() << " camera rays in packets of " << n
+			  << (world.traces_packets() ? "" : " (some objects traced a ray at a time)") << ", best of "
+			  << repeats << '\n';
+	auto run = [&](const char* label, auto body) {
+		double best = infinity, sum = 0;
+		size_t hits = 0;
+		for (int k = 0; k < repeats; k++)
+		{
+			sum = 0;
+			hits = 0;
+			auto start = std::chrono::steady_clock::now();
+			body(hits, sum);
+			best = fmin(best, seconds_since(start));
+		}
+		std::cout << "  " << std::setw(11) << label << ": " << std::fixed << std::setprecision(2)
+				  << rays.size() / best * 1e-6 << " Mrays/s (" << hits << " hits, checksum "
+				  << std::setprecision(4) << sum << ")\n" << std::defaultfloat;
+	};
+
+	run("single rays", [&](size_t& hits, double& sum) {
+		for (size_t k = 0; k < rays.size(); k++)
+		{
+			seed_random(k);
+			hit_record rec;
+			if (world.hit(rays[k], 0.001, infinity, rec))
+			{
+				hits++;
+				sum += rec.t + rec.p.x();
+			}
+		}
+	});
+	run("packets", [&](size_t& hits, double& sum) {
+		pcg32 streams[ray_packet::width];
+		hit_record recs[ray_packet::width];
+		for (size_t k = 0; k < rays.size(); k += n)
+		{
+			ray_packet packet;
+			for (int i = 0; i < n; i++)
+			{
+				seed_random(k + i);
+				streams[i] = random_generator();
+				packet.add(rays[k + i]);
+			}
+			packet.finish();
+			int mask = hit_packet(world, packet, streams, recs);
+			for (int i = 0; i < n; i++)
+			{
+				if ((mask >> i) & 1)
+				{
+					hits++;
+					sum += recs[i].t + recs[i].p.x();
+				}
+			}
+		}
+	});
+}
+
+// Shadow rays from the first hit of each camera ray to a random point on a
+// light, answered by hit() with a full record and by the any-hit
+// occluded(). Both must agree on how many are blocked.
+inline void bench_occlusion(const hittable_list& world, const camera& cam, int width, int height, int repeats = 3)
+{
+	light_list lights(world);
+	if (lights.empty())
+		return;
+
+	std::vector<ray> rays;
+	std::vector<real> lengths;
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			seed_random(y * width + x);
+			ray r = cam.get_ray((x + random_double()) / (width - 1), (y + random_double()) / (height - 1));
+			hit_record rec, light_rec;
+			if (!world.hit(r, 0.001, infinity, rec))
+				continue;
+			ray shadow(rec.p, lights.random(rec.p), r.time());
+			if (!lights.hit(shadow, light_rec))
+				continue;
+			rays.push_back(shadow);
+			lengths.push_back(light_rec.t * real(1 - 1e-4));
+		}
+	}
+
+	std::cout << "occlusion: " << rays.size() << " shadow rays, best of " << repeats << '\n';
+	auto run = [&](const char* name, auto blocked) {
+		double best = infinity;
+		size_t count = 0;
+		for (int k = 0; k < repeats; k++)
+		{
+			count = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (size_t n = 0; n < rays.size(); n++)
+			{
+				// constant_medium draws random numbers; keep them the same per ray.
+				seed_random(n);
+				count += blocked(rays[n], lengths[n]);
+			}
+			best = fmin(best, seconds_since(start));
+		}
+		std::cout << "  " << std::setw(8) << name << ": " << std::fixed << std::setprecision(2)
+				  << rays.size() / best * 1e-6 << " Mrays/s (" << count << " blocked)\n";
+	};
+	run("hit", [&](const ray& r, real t_max) {
+		hit_record rec;
+		return world.hit(r, 0.001, t_max, rec);
+	});
+	run("occluded", [&](const ray& r, real t_max) { return world.occluded(r, 0.001, t_max); });
+}
+
+// The lookup image_texture did before MIP mapping: nearest texel of a
+// row-major stbi_load buffer. Kept here only as the benchmark baseline.
+inline color legacy_nearest_texel(const unsigned char* data, int width, int height, real u, real v)
+{
+	auto i = std::min(static_cast<int>(clamp(u, 0.0, 1.0) * width), width - 1);
+	auto j = std::min(static_cast<int>((1 - clamp(v, 0.0, 1.0)) * height), height - 1);
+	auto pixel = data + (size_t(j) * width + i) * 3;
+	return color(pixel[0] / 255.0, pixel[1] / 255.0, pixel[2] / 255.0);
+}
+
+// The texture of one sphere seen by camera rays, one jittered ray per pixel.
+// Reports lookups per second of the old nearest lookup and the tiled
+// trilinear one, and how far each pixel lands from the pixel's true average
+// (nearest over reference_spp rays), which is the aliasing the renderer
+// would otherwise have to average away with more samples.
+inline void bench_texture(const char* filename, const point3& center, real radius, camera cam,
+	int width, int height, int reference_spp = 256, int repeats = 5)
+{
+	int tw, th, n = 3;
+	auto data = stbi_load(filename, &tw, &th, &n, 3);
+	if (!data)
+		return;
+	image_texture tex(filename);
+	sphere ball(center, radius, nullptr);
+	cam.set_image_width(width);
+
+	struct lookup { real u, v, width; color truth; };
+	std::vector<lookup> lookups;
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			lookup l{};
+			int hits = 0;
+			for (int s = 0; s <= reference_spp; s++)
+			{
+				seed_random(y * width + x, s);
+				ray r = cam.get_ray((x + random_double()) / (width - 1), (y + random_double()) / (height - 1));
+				hit_record rec;
+				if (!ball.hit(r, 0.001, infinity, rec))
+					continue;
+				if (s == 0)
+				{
+					l.u = rec.u;
+					l.v = rec.v;
+					l.width = r.width_at(rec.t) * rec.uv_scale;
+					hits++;
+					continue;
+				}
+				l.truth += legacy_nearest_texel(data, tw, th, rec.u, rec.v);
+			}
+			if (hits)
+			{
+				l.truth /= reference_spp;
+				lookups.push_back(l);
+			}
+		}
+	}
+
+	std::cout << "texture: " << lookups.size() << " lookups into " << tw << "x" << th << ", best of " << repeats << '\n';
+	auto run = [&](const char* name, auto value) {
+		double best = infinity, error = 0;
+		for (int k = 0; k < repeats; k++)
+		{
+			error = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (const auto& l : lookups)
+			{
+				auto c = value(l);
+				error += (c - l.truth).length_squared();
+			}
+			best = fmin(best, seconds_since(start));
+		}
+		std::cout << "  " << std::setw(9) << name << ": " << std::fixed << std::setprecision(2)
+				  << lookups.size() / best * 1e-6 << " Mlookups/s, rmse against the pixel average "
+				  << std::setprecision(4) << sqrt(error / (3 * lookups.size())) << '\n';
+	};
+	run("nearest", [&](const lookup& l) { return legacy_nearest_texel(data, tw, th, l.u, l.v); });
+	run("bilinear", [&](const lookup& l) { return tex.value(l.u, l.v, point3()); });
+	run("trilinear", [&](const lookup& l) { return tex.filtered_value(l.u, l.v, point3(), l.width); });
+
+	// The same lookups with the texture cache held to a quarter of the
+	// pyramid, so pages are evicted and loaded again along the way.
+	auto& cache = texture_cache::global();
+	auto before = cache.stats();
+	cache.set_budget(before.peak_bytes / 4);
+	texture_stats::local() = texture_stats();
+	run("paged", [&](const lookup& l) { return tex.filtered_value(l.u, l.v, point3(), l.width); });
+	auto after = cache.stats();
+	std::cout << "             " << texture_stats::local().hits << " hits, " << texture_stats::local().misses
+			  << " misses, " << after.evictions - before.evictions << " evictions in "
+			  << after.budget / 1024 << " KiB\n";
+	texture_stats::local() = texture_stats();
+	cache.set_budget(before.budget);
+	stbi_image_free(data);
+}
@@ -1,14 +1,36 @@
 #pragma once
 #include "aarec.h"
-#include "hittable_list.h"
 
+// Axis-aligned box intersected with a single slab test. Shades exactly like
+// the six-rect construction it replaces: the hit face is the slab the ray
+// enters through (or leaves through, when it starts inside), its outward
+// normal picks front_face, and (u, v) follow the matching xy/xz/yz_rect.
 class box : public hittable
 {
 public:
 	box() {}
-	box(const point3& p0, const point3& p1, shared_ptr<material> ptr);
-	virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
-	virtual bool bounding_box(double t0, double t1, aabb& output_box) const
+	box(const point3& p0, const point3& p1, shared_ptr<material> ptr)
+		: box_min(p0), box_max(p1), mp(ptr) {}
+	virtual bool hit(const ray& r, real t0, real t1, hit_record& rec) const;
+	// Attributes are cheap here; skips the default's second virtual call.
+	virtual bool hit_deferred(const ray& r, real t0, real t1, hit_record& rec) const
+	{
+		if (!box::hit(r, t0, t1, rec))
+			return false;
+		rec.object = nullptr;
+		return true;
+	}
+	virtual int hit_packet(ray_packet& p, int mask, packet_hits& hits) const;
+	virtual bool traces_packets() const { return true; }
+	virtual bool occluded(const ray& r, real t0, real t1) const
+	{
+		real t_enter, t_exit;
+		int enter_axis, exit_axis;
+		if (!slabs(r, t_enter, enter_axis, t_exit, exit_axis))
+			return false;
+		return (t_enter >= t0 && t_enter <= t1) || (t_exit >= t0 && t_exit <= t1);
+	}
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const
 	{
 		output_box = aabb(box_min, box_max);
 		return true;
@@ -16,27 +38,131 @@ public:
 public:
 	point3 box_min;
 	point3 box_max;
-	hittable_list sides;
+	shared_ptr<material> mp;
+
+private:
+	// Where the line of r enters and leaves the box, and through which
+	// axis' slab; false if it misses.
+	bool slabs(const ray& r, real& t_enter, int& enter_axis, real& t_exit, int& exit_axis) const;
 };
 
-box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr)
-{
-	box_min = p0;
-	box_max = p1;
+template <> struct arena_allocatable<box> : std::true_type {};
 
-	sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-	sides.add(make_shared<flip_face>
-		(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr)));
+bool box::slabs(const ray& r, real& t_enter, int& enter_axis, real& t_exit, int& exit_axis) const
+{
+	t_enter = -infinity;
+	t_exit = infinity;
+	enter_axis = exit_axis = 0;
 
-	sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-	sides.add(make_shared<flip_face>(
-		make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr)));
+	for (int a = 0; a < 3; a++)
+	{
+		auto o = r.origin()[a];
+		auto d = r.direction()[a];
+		if (d == 0)
+		{
+			// Parallel to this slab: inside it for the whole ray, or never.
+			if (o < box_min[a] || o > box_max[a])
+				return false;
+			continue;
+		}
+		auto ta = (box_min[a] - o) * r.inv_dir[a];
+		auto tb = (box_max[a] - o) * r.inv_dir[a];
+		auto near_t = ta < tb ? ta : tb;
+		auto far_t = ta < tb ? tb : ta;
+		if (near_t > t_enter)
+		{
+			t_enter = near_t;
+			enter_axis = a;
+		}
+		if (far_t < t_exit)
+		{
+			t_exit = far_t;
+			exit_axis = a;
+		}
+	}
+	return t_enter <= t_exit;
+}
 
-	sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-	sides.add(make_shared<flip_face>(
-		make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr)));
+// slabs() and hit()'s choice of t over every lane at once; the axes the
+// faces are on wait for the lane to be completed.
+int box::hit_packet(ray_packet& p, int mask, packet_hits& hits) const
+{
+	alignas(32) real t_enter[ray_packet::width], t_exit[ray_packet::width], lanes[ray_packet::width];
+	ray_packet::unpack(mask, lanes);
+	for (int i = 0; i < ray_packet::width; i++)
+	{
+		t_enter[i] = -infinity;
+		t_exit[i] = infinity;
+	}
+	for (int a = 0; a < 3; a++)
+	{
+		for (int i = 0; i < ray_packet::width; i++)
+		{
+			auto o = p.o[a][i];
+			auto d = p.d[a][i];
+			auto ta = (box_min[a] - o) * p.inv[a][i];
+			auto tb = (box_max[a] - o) * p.inv[a][i];
+			auto near_t = ta < tb ? ta : tb;
+			auto far_t = ta < tb ? tb : ta;
+			// A lane parallel to this slab skips it, as in slabs().
+			bool parallel = d == 0;
+			bool outside = parallel & ((o < box_min[a]) | (o > box_max[a]));
+			lanes[i] = outside ? 0 : lanes[i];
+			t_enter[i] = !parallel & (near_t > t_enter[i]) ? near_t : t_enter[i];
+			t_exit[i] = !parallel & (far_t < t_exit[i]) ? far_t : t_exit[i];
+		}
+	}
+	for (int i = 0; i < ray_packet::width; i++)
+	{
+		bool enters = (t_enter[i] >= p.t_min) & (t_enter[i] <= p.t_max[i]);
+		bool exits = (t_exit[i] >= p.t_min) & (t_exit[i] <= p.t_max[i]);
+		bool hit = (lanes[i] != 0) & (t_enter[i] <= t_exit[i]) & (enters | exits);
+		p.t_max[i] = hit ? (enters ? t_enter[i] : t_exit[i]) : p.t_max[i];
+		lanes[i] = hit ? 1 : 0;
+	}
+	return hits.lowered_by(this, ray_packet::pack(lanes));
 }
 
-bool box::hit(const ray& r, double t0, double t1, hit_record& rec) const {
-	return sides.hit(r, t0, t1, rec);
-}
\ No newline at end of file
+bool box::hit(const ray& r, real t0, real t1, hit_record& rec) const {
+	real t_enter, t_exit;
+	int enter_axis, exit_axis;
+	if (!slabs(r, t_enter, enter_axis, t_exit, exit_axis))
+		return false;
+
+	real t;
+	int axis;
+	bool max_side;
+	if (t_enter >= t0 && t_enter <= t1)
+	{
+		t = t_enter;
+		axis = enter_axis;
+		max_side = r.direction()[axis] < 0;
+	}
+	else if (t_exit >= t0 && t_exit <= t1)
+	{
+		t = t_exit;
+		axis = exit_axis;
+		max_side = r.direction()[axis] > 0;
+	}
+	else
+		return false;
+
+	rec.t = t;
+	rec.p = r.at(t);
+
+	// The two in-plane axes, in the order the matching rect uses for (u, v).
+	int ua = axis == 0 ? 1 : 0;
+	int va = axis == 2 ? 1 : 2;
+	auto along = [&](int a) {
+		return (r.origin()[a] + t * r.direction()[a] - box_min[a]) / (box_max[a] - box_min[a]);
+	};
+	rec.u = along(ua);
+	rec.v = along(va);
+	rec.uv_scale = 0;
+
+	vec3 outward_normal(0, 0, 0);
+	outward_normal[axis] = max_side ? 1 : -1;
+	rec.set_face_normal(r, outward_normal);
+	rec.mat_ptr = mp.get();
+	return true;
+}
@@ -1,21 +1,63 @@
 #pragma once
 #include "rtweekend.h"
 #include "hittable_list.h"
+#include "arena.h"
 #include <algorithm>
 
+// How bvh_node chooses the split at each level.
+enum class bvh_strategy
+{
+	random_axis,	// sort on a random axis, split at the median
+	sah				// binned surface area heuristic over all three axes
+};
+
 class bvh_node : public hittable
 {
 public:
 	bvh_node();
 
-	bvh_node(hittable_list& list, double time0, double time1)
-		:bvh_node(list.objects, 0, list.objects.size(), time0, time1) {}
+	// With an arena, inner nodes are allocated from it instead of the heap,
+	// unless they would hold objects from the heap.
+	bvh_node(hittable_list& list, real time0, real time1,
+		bvh_strategy strategy = bvh_strategy::random_axis, scene_arena* arena = nullptr)
+		:bvh_node(list.objects, 0, list.objects.size(), time0, time1, strategy,
+			arena_held(list) ? arena : nullptr) {}
 
+	// Given an arena, objects must all have come from it.
 	bvh_node(std::vector<shared_ptr<hittable>>& objects,
-		size_t start, size_t end, double time0, double time1);
+		size_t start, size_t end, real time0, real time1,
+		bvh_strategy strategy = bvh_strategy::random_axis, scene_arena* arena = nullptr);
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
-	virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+	{
+		if (!hit_deferred(r, t_min, t_max, rec))
+			return false;
+		complete_hit(r, rec);
+		return true;
+	}
+	virtual bool hit_deferred(const ray& r, real t_min, real t_max, hit_record& rec) const;
+	virtual bool occluded(const ray& r, real t_min, real t_max) const
+	{
+		return box.hit(r, t_min, t_max) && (left->occluded(r, t_min, t_max) || right->occluded(r, t_min, t_max));
+	}
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const;
+	virtual void collect_lights(light_collection& out) const
+	{
+		left->collect_lights(out);
+		// A node over a single object holds it on both sides.
+		if (right != left)
+			right->collect_lights(out);
+	}
+
+	// Expected cost of a random ray through this tree, relative to one
+	// primitive test: traversal_cost per visited node plus one per primitive,
+	// weighted by surface area ratios. Lower is better.
+	double sah_cost(real t0, real t1, double traversal_cost = 1.0) const;
+
+	static const int sah_bins = 16;
+
+	static size_t sah_partition(std::vector<shared_ptr<hittable>>& objects,
+		size_t start, size_t end, real time0, real time1);
 
 public:
 	shared_ptr<hittable> left;
@@ -23,18 +65,20 @@ public:
 	aabb box;
 };
 
-bool bvh_node::bounding_box(double t0, double t1, aabb& output_box) const
+template <> struct arena_allocatable<bvh_node> : std::true_type {};
+
+bool bvh_node::bounding_box(real t0, real t1, aabb& output_box) const
 {
 	output_box = box;
 	return true;
 }
 
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool bvh_node::hit_deferred(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
 	if (!box.hit(r, t_min, t_max))
 		return false;
-	bool hit_left = left->hit(r, t_min, t_max, rec);
-	bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+	bool hit_left = left->hit_deferred(r, t_min, t_max, rec);
+	bool hit_right = right->hit_deferred(r, t_min, hit_left ? rec.t : t_max, rec);
 
 	return hit_left || hit_right;
 }
@@ -63,34 +107,147 @@ bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
 	return box_compare(a, b, 2);
 }
 
-bvh_node::bvh_node(std::vector<shared_ptr<hittable>>& objects,
-	size_t start, size_t end, double time0, double time1)
+double bvh_node::sah_cost(real t0, real t1, double traversal_cost) const
 {
-	int axis = random_int(0, 2);
-	auto comparator = (axis == 0) ? box_x_compare
-		: (axis == 1) ? box_y_compare
-		: box_z_compare;
+	auto child_cost = [&](const shared_ptr<hittable>& child) {
+		auto node = dynamic_cast<const bvh_node*>(child.get());
+		return node ? node->sah_cost(t0, t1, traversal_cost) : 1.0;
+	};
+
+	auto area = box.surface_area();
+	aabb box_left, box_right;
+	left->bounding_box(t0, t1, box_left);
+	right->bounding_box(t0, t1, box_right);
+
+	auto p_left = area > 0 ? box_left.surface_area() / area : 1.0;
+	auto p_right = area > 0 ? box_right.surface_area() / area : 1.0;
+	return traversal_cost + p_left * child_cost(left) + p_right * child_cost(right);
+}
+
+// Bins the objects' centroids into sah_bins slots along each axis and picks
+// the bin boundary with the lowest area * count cost. Reorders
+// objects[start, end) so the left half comes first and returns the split.
+size_t bvh_node::sah_partition(std::vector<shared_ptr<hittable>>& objects,
+	size_t start, size_t end, real time0, real time1)
+{
+	struct bin
+	{
+		aabb bounds;
+		int count = 0;
+	};
+
+	std::vector<aabb> boxes(end - start);
+	point3 cmin(infinity, infinity, infinity);
+	point3 cmax(-infinity, -infinity, -infinity);
+	for (size_t i = start; i < end; i++)
+	{
+		if (!objects[i]->bounding_box(time0, time1, boxes[i - start]))
+			std::cerr << "No bounding box in bvh_node constructor.\n";
+		auto c = 0.5 * (boxes[i - start].min() + boxes[i - start].max());
+		for (int a = 0; a < 3; a++)
+		{
+			cmin[a] = fmin(cmin[a], c[a]);
+			cmax[a] = fmax(cmax[a], c[a]);
+		}
+	}
+
+	auto bin_of = [&](const aabb& b, int axis) {
+		auto c = 0.5 * (b.min()[axis] + b.max()[axis]);
+		auto k = static_cast<int>(sah_bins * (c - cmin[axis]) / (cmax[axis] - cmin[axis]));
+		return k < sah_bins ? k : sah_bins - 1;
+	};
 
+	int best_axis = -1;
+	int best_split = 0;
+	double best_cost = infinity;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (cmax[axis] <= cmin[axis])
+			continue;
+
+		bin bins[sah_bins];
+		for (const auto& b : boxes)
+		{
+			auto& slot = bins[bin_of(b, axis)];
+			slot.bounds = slot.count ? surrounding_box(slot.bounds, b) : b;
+			slot.count++;
+		}
+
+		// right_area[k] / right_count[k] cover bins k..sah_bins-1
+		double right_area[sah_bins];
+		int right_count[sah_bins];
+		aabb acc;
+		int n = 0;
+		for (int k = sah_bins - 1; k > 0; k--)
+		{
+			if (bins[k].count)
+			{
+				acc = n ? surrounding_box(acc, bins[k].bounds) : bins[k].bounds;
+				n += bins[k].count;
+			}
+			right_area[k] = n ? acc.surface_area() : 0.0;
+			right_count[k] = n;
+		}
+
+		n = 0;
+		for (int k = 0; k < sah_bins - 1; k++)
+		{
+			if (bins[k].count)
+			{
+				acc = n ? surrounding_box(acc, bins[k].bounds) : bins[k].bounds;
+				n += bins[k].count;
+			}
+			if (n == 0 || right_count[k + 1] == 0)
+				continue;
+			auto cost = n * acc.surface_area() + right_count[k + 1] * right_area[k + 1];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = k + 1;
+			}
+		}
+	}
+
+	// All centroids coincide: any split is as good as another.
+	if (best_axis < 0)
+		return start + (end - start) / 2;
+
+	auto mid = std::partition(objects.begin() + start, objects.begin() + end,
+		[&](const shared_ptr<hittable>& object) {
+			aabb b;
+			object->bounding_box(time0, time1, b);
+			return bin_of(b, best_axis) < best_split;
+		});
+	return mid - objects.begin();
+}
+
+bvh_node::bvh_node(std::vector<shared_ptr<hittable>>& objects,
+	size_t start, size_t end, real time0, real time1, bvh_strategy strategy, scene_arena* arena)
+{
 	size_t object_span = end - start;
 
 	if (object_span == 1)
 		left = right = objects[start];
 	else if (object_span == 2) {
-		if (comparator(objects[start], objects[start + 1])) {
-			left = objects[start];
-			right = objects[start + 1];
-		}
-		else {
-			left = objects[start];
-			right = objects[start + 1];
-		}
+		left = objects[start];
+		right = objects[start + 1];
 	}
 	else {
-		std::sort(objects.begin() + start, objects.begin() + end, comparator);
-
-		auto mid = start + object_span / 2;
-		left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-		right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+		size_t mid;
+		if (strategy == bvh_strategy::sah)
+			mid = sah_partition(objects, start, end, time0, time1);
+		else {
+			int axis = random_int(0, 2);
+			auto comparator = (axis == 0) ? box_x_compare
+				: (axis == 1) ? box_y_compare
+				: box_z_compare;
+			std::sort(objects.begin() + start, objects.begin() + end, comparator);
+			mid = start + object_span / 2;
+		}
+		left = make_shared_in<bvh_node>(arena, objects, start, mid, time0, time1, strategy, arena);
+		right = make_shared_in<bvh_node>(arena, objects, mid, end, time0, time1, strategy, arena);
 	}
 
 	aabb box_left, box_right;
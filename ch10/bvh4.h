@@ -0,0 +1,333 @@
+#pragma once
+#include "linear_bvh.h"
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_BVH4_SSE 1
+#include <emmintrin.h>
+#endif
+
+// A 4-wide BVH node. The four child boxes are stored structure-of-arrays so
+// one set of SIMD slab tests covers all of them. A child index >= 0 is an
+// inner node; a leaf is stored as ~first_primitive with its length in count.
+struct alignas(16) bvh4_node
+{
+	float bounds_min[3][4];	// [axis][child]
+	float bounds_max[3][4];
+	int32_t child[4];
+	uint16_t count[4];		// primitives per leaf child
+	int32_t children;		// used slots: 2 to 4, or 1 in the root of a one-leaf tree
+};
+
+// Alternative to bvh_node/linear_bvh: collapses a binary tree into 4-wide
+// nodes and intersects all four children of a node at once.
+class bvh4 : public hittable
+{
+public:
+	static const int stack_size = 128;	// on the call stack; deeper trees use the heap
+
+	bvh4(const hittable_list& list, real time0, real time1)
+		: bvh4(linear_bvh(list, time0, time1)) {}
+
+	bvh4(const linear_bvh& tree);
+
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+	{
+		if (!hit_deferred(r, t_min, t_max, rec))
+			return false;
+		complete_hit(r, rec);
+		return true;
+	}
+	virtual bool hit_deferred(const ray& r, real t_min, real t_max, hit_record& rec) const;
+	virtual bool occluded(const ray& r, real t_min, real t_max) const;
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const;
+	virtual void collect_lights(light_collection& out) const
+	{
+		for (const auto& primitive : primitives)
+			primitive->collect_lights(out);
+	}
+
+	size_t memory_bytes() const { return nodes.size() * sizeof(bvh4_node); }
+
+public:
+	std::vector<bvh4_node> nodes;
+	std::vector<shared_ptr<hittable>> primitives;
+	aabb box;
+	int depth = 0;		// levels of 4-wide nodes down to the deepest one
+
+private:
+	float pad = 0;
+
+	int collapse(const linear_bvh& tree, int index, int level = 1);
+
+	// As linear_bvh::traverse, visiting children and leaves near to far.
+	template <class F>
+	void traverse(const ray& r, real t_min, const real& t_max, F leaf) const;
+
+	// Writes the entry distance of each child into tnear and returns a bit
+	// mask of the children the ray segment overlaps.
+	static int intersect_children(const bvh4_node& node, const float origin[3],
+		const float inv_dir[3], const int sign[3], float t_min, float t_max, float tnear[4]);
+};
+
+bvh4::bvh4(const linear_bvh& tree) : primitives(tree.primitives), box(tree.box)
+{
+	if (tree.nodes.empty())
+		return;
+
+	// Traversal narrows the ray origin to float as well, which moves it by up
+	// to half an ulp of its largest coordinate. Pad every box by a few ulps of
+	// the scene's extent so that shift can never cull a real hit.
+	float extent = 1;
+	for (int a = 0; a < 3; a++)
+		extent = std::fmax(extent, std::fmax(fabs(box.min()[a]), fabs(box.max()[a])));
+	pad = 4 * (std::nextafter(extent, HUGE_VALF) - extent);
+
+	if (tree.nodes[0].is_leaf())
+	{
+		// Give a one-leaf tree an inner node so traversal always starts at one.
+		bvh4_node root{};
+		for (int a = 0; a < 3; a++)
+		{
+			for (int k = 0; k < 4; k++)
+			{
+				root.bounds_min[a][k] = tree.nodes[0].bounds_min[a] - pad;
+				root.bounds_max[a][k] = tree.nodes[0].bounds_max[a] + pad;
+			}
+		}
+		root.child[0] = ~tree.nodes[0].offset;
+		root.count[0] = tree.nodes[0].count;
+		root.children = 1;
+		nodes.push_back(root);
+		depth = 1;
+		return;
+	}
+	collapse(tree, 0);
+}
+
+// Pulls up to four descendants of a binary inner node into one node,
+// always opening the child with the largest surface area next.
+int bvh4::collapse(const linear_bvh& tree, int index, int level)
+{
+	depth = std::max(depth, level);
+	auto area = [&](int i) {
+		const auto& n = tree.nodes[i];
+		auto dx = n.bounds_max[0] - n.bounds_min[0];
+		auto dy = n.bounds_max[1] - n.bounds_min[1];
+		auto dz = n.bounds_max[2] - n.bounds_min[2];
+		return dx * dy + dy * dz + dz * dx;
+	};
+
+	int slots[4] = { index + 1, tree.nodes[index].offset, -1, -1 };
+	int used = 2;
+	while (used < 4)
+	{
+		int best = -1;
+		for (int k = 0; k < used; k++)
+		{
+			if (!tree.nodes[slots[k]].is_leaf() && (best < 0 || area(slots[k]) > area(slots[best])))
+				best = k;
+		}
+		if (best < 0)
+			break;
+		int opened = slots[best];
+		slots[best] = opened + 1;
+		slots[used++] = tree.nodes[opened].offset;
+	}
+
+	int me = static_cast<int>(nodes.size());
+	nodes.emplace_back();
+	for (int k = 0; k < 4; k++)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			// Unused slots get an inverted box, which no slab test accepts.
+			nodes[me].bounds_min[a][k] = k < used ? tree.nodes[slots[k]].bounds_min[a] - pad : HUGE_VALF;
+			nodes[me].bounds_max[a][k] = k < used ? tree.nodes[slots[k]].bounds_max[a] + pad : -HUGE_VALF;
+		}
+		nodes[me].child[k] = 0;
+		nodes[me].count[k] = 0;
+	}
+	nodes[me].children = used;
+
+	for (int k = 0; k < used; k++)
+	{
+		const auto& n = tree.nodes[slots[k]];
+		if (n.is_leaf())
+		{
+			nodes[me].child[k] = ~n.offset;
+			nodes[me].count[k] = n.count;
+		}
+		else
+		{
+			int c = collapse(tree, slots[k], level + 1);
+			nodes[me].child[k] = c;
+		}
+	}
+	return me;
+}
+
+bool bvh4::bounding_box(real t0, real t1, aabb& output_box) const
+{
+	output_box = box;
+	return !nodes.empty();
+}
+
+int bvh4::intersect_children(const bvh4_node& node, const float origin[3],
+	const float inv_dir[3], const int sign[3], float t_min, float t_max, float tnear[4])
+{
+#ifdef RT_BVH4_SSE
+	// _mm_max_ps/_mm_min_ps return the second operand when either is NaN, so
+	// keeping the running interval second makes 0 * inf lanes drop out.
+	__m128 near_t = _mm_set1_ps(t_min);
+	__m128 far_t = _mm_set1_ps(t_max);
+	for (int a = 0; a < 3; a++)
+	{
+		const float* lo = sign[a] ? node.bounds_max[a] : node.bounds_min[a];
+		const float* hi = sign[a] ? node.bounds_min[a] : node.bounds_max[a];
+		__m128 o = _mm_set1_ps(origin[a]);
+		__m128 inv = _mm_set1_ps(inv_dir[a]);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(lo), o), inv);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(hi), o), inv);
+		near_t = _mm_max_ps(t0, near_t);
+		far_t = _mm_min_ps(t1, far_t);
+	}
+	_mm_storeu_ps(tnear, near_t);
+	return _mm_movemask_ps(_mm_cmple_ps(near_t, far_t));
+#else
+	int mask = 0;
+	for (int k = 0; k < 4; k++)
+	{
+		float near_t = t_min;
+		float far_t = t_max;
+		for (int a = 0; a < 3; a++)
+		{
+			float lo = sign[a] ? node.bounds_max[a][k] : node.bounds_min[a][k];
+			float hi = sign[a] ? node.bounds_min[a][k] : node.bounds_max[a][k];
+			float t0 = (lo - origin[a]) * inv_dir[a];
+			float t1 = (hi - origin[a]) * inv_dir[a];
+			near_t = t0 > near_t ? t0 : near_t;
+			far_t = t1 < far_t ? t1 : far_t;
+		}
+		tnear[k] = near_t;
+		if (near_t <= far_t)
+			mask |= 1 << k;
+	}
+	return mask;
+#endif
+}
+
+template <class F>
+void bvh4::traverse(const ray& r, real t_min, const real& t_max, F leaf) const
+{
+	if (nodes.empty())
+		return;
+
+	float origin[3], inv_dir[3];
+	int sign[3];
+	for (int a = 0; a < 3; a++)
+	{
+		origin[a] = static_cast<float>(r.orig[a]);
+		inv_dir[a] = static_cast<float>(r.inv_dir[a]);
+		sign[a] = r.sign[a];
+	}
+
+	// Rounding t to float must not shrink the interval either; two float ulps
+	// of slack covers it, and infinities pass through unchanged.
+	const float tmin_f = static_cast<float>(t_min) * (t_min > 0 ? 1 - 2.5e-7f : 1 + 2.5e-7f);
+	auto widen_max = [](real t) {
+		auto f = static_cast<float>(t);
+		return f * (f > 0 ? 1 + 2.5e-7f : 1 - 2.5e-7f);
+	};
+
+	// Stack entries are child references as stored in bvh4_node::child, so
+	// leaves wait their turn in near-to-far order like inner nodes do.
+	struct entry
+	{
+		int32_t child;
+		uint16_t count;
+		float tnear;
+	};
+	// Each node popped pushes at most four entries in its place, so the
+	// stack never holds more than three per level plus the root.
+	entry local[stack_size];
+	std::vector<entry> deep;
+	entry* stack = local;
+	if (3 * depth + 1 > stack_size)
+	{
+		deep.resize(3 * depth + 1);
+		stack = deep.data();
+	}
+	int top = 0;
+	stack[top++] = { 0, 0, tmin_f };
+
+	while (top > 0)
+	{
+		auto e = stack[--top];
+		float tmax_f = widen_max(t_max);
+		if (e.tnear > tmax_f)
+			continue;
+
+		if (e.child < 0)
+		{
+			int first = ~e.child;
+			if (leaf(first, first + e.count))
+				return;
+			continue;
+		}
+
+		const auto& node = nodes[e.child];
+		float tnear[4];
+		int mask = intersect_children(node, origin, inv_dir, sign, tmin_f, tmax_f, tnear);
+
+		// Push the children that were hit far to near so the nearest pops first.
+		int order[4];
+		int n = 0;
+		for (int k = 0; k < node.children; k++)
+		{
+			if (!(mask & (1 << k)))
+				continue;
+			int i = n++;
+			while (i > 0 && tnear[order[i - 1]] < tnear[k])
+			{
+				order[i] = order[i - 1];
+				i--;
+			}
+			order[i] = k;
+		}
+		for (int i = 0; i < n; i++)
+		{
+			int k = order[i];
+			stack[top++] = { node.child[k], node.count[k], tnear[k] };
+		}
+	}
+}
+
+bool bvh4::hit_deferred(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	bool hit_anything = false;
+	auto closest_so_far = t_max;
+	traverse(r, t_min, closest_so_far, [&](int first, int last) {
+		for (int p = first; p < last; p++)
+		{
+			if (primitives[p]->hit_deferred(r, t_min, closest_so_far, rec))
+			{
+				hit_anything = true;
+				closest_so_far = rec.t;
+			}
+		}
+		return false;
+	});
+	return hit_anything;
+}
+
+bool bvh4::occluded(const ray& r, real t_min, real t_max) const
+{
+	bool blocked = false;
+	traverse(r, t_min, t_max, [&](int first, int last) {
+		for (int p = first; p < last && !blocked; p++)
+			blocked = primitives[p]->occluded(r, t_min, t_max);
+		return blocked;
+	});
+	return blocked;
+}
@@ -8,12 +8,12 @@ public:
 		point3 lookfrom,
 		point3 lookat,
 		vec3 vup,
-		double vfov,
-		double aspect_ratio,
-		double aperture,
-		double focus_dist,
-		double t0 = 0,
-		double t1 = 0)
+		real vfov,
+		real aspect_ratio,
+		real aperture,
+		real focus_dist,
+		real t0 = 0,
+		real t1 = 0)
 	{
 		auto theta = degrees_to_radians(vfov);
 		auto h = tan(theta / 2);
@@ -30,12 +30,22 @@ public:
 		time0 = t0;
 		time1 = t1;
 	}
-	ray get_ray(double s, double t) const
+	ray get_ray(real s, real t) const
 	{
 		vec3 rd = lens_radius * random_in_unit_disk();
 		vec3 offset = u * rd.x() + v * rd.y();
 
-		return ray(origin + offset, lower_left_corner + s * horizontal + t * vertical - origin - offset, random_double(time0, time1));
+		ray r(origin + offset, lower_left_corner + s * horizontal + t * vertical - origin - offset, random_double(time0, time1));
+		// The image plane sits at t = 1, where the cone is a pixel wide.
+		if (pixel_size > 0)
+			r.cone_angle = pixel_size / r.direction().length();
+		return r;
+	}
+
+	// Gives camera rays a cone one pixel wide for texture filtering.
+	void set_image_width(int image_width)
+	{
+		pixel_size = horizontal.length() / image_width;
 	}
 private:
 	point3 origin;
@@ -43,6 +53,7 @@ private:
 	vec3 horizontal;
 	vec3 vertical;
 	vec3 u, v, w;
-	double lens_radius;
-	double time0, time1;
+	real lens_radius;
+	real time0, time1;
+	real pixel_size = 0;
 };
\ No newline at end of file
@@ -5,30 +5,31 @@
 class constant_medium : public hittable
 {
 public:
-	constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a) : boundary(b), neg_inv_density(-1 / d) {
+	constant_medium(shared_ptr<hittable> b, real d, shared_ptr<texture> a) : boundary(b), neg_inv_density(-1 / d) {
 		phase_function = make_shared<isotropic>(a);
 	}
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
-	virtual bool bounding_box(double t0, double t1, aabb& output_box) const
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const
 	{
 		return boundary->bounding_box(t0, t1, output_box);
 	}
 public:
 	shared_ptr<hittable> boundary;
 	shared_ptr<material> phase_function;
-	double neg_inv_density;
+	real neg_inv_density;
 };
 
-bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool constant_medium::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
 	// Print occasional samples when debugging.To enable, set enableDebug true.
 	const bool enableDebug = false;
 	const bool debugging = enableDebug && random_double() < 0.00001;
 
 	hit_record rec1, rec2;
 
-	if (!boundary->hit(r, -infinity, infinity, rec1))
+	// Only the boundary distances are needed, never its surface attributes.
+	if (!boundary->hit_deferred(r, -infinity, infinity, rec1))
 		return false;
-	if (!boundary->hit(r, rec1.t + 0.0001, infinity, rec2))
+	if (!boundary->hit_deferred(r, rec1.t + 0.0001, infinity, rec2))
 		return false;
 
 	if (debugging) std::cerr << "\nt0=" << rec1.t << ", t1=" << rec2.t << '\n';
@@ -57,7 +58,8 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
 
 	rec.normal = vec3(1, 0, 0); //arbitrary
 	rec.front_face = true; // arbitrary
-	rec.mat_ptr = phase_function;
+	rec.uv_scale = 0;	// a volume has no surface to filter over
+	rec.mat_ptr = phase_function.get();
 
 	return true;
 }
\ No newline at end of file
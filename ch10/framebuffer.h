@@ -0,0 +1,347 @@
+#pragma once
+#include "rtweekend.h"
+#include "stb_image_write.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Linear float32 RGB image, rows from the top. Renders are kept in this form
+// until the very end: the float files written from it keep the full range
+// and can be averaged across passes or machines, and tonemap() derives the
+// 8-bit image from it as a last step.
+class framebuffer
+{
+public:
+	framebuffer(int width, int height) : width(width), height(height), pixels(size_t(width) * height * 3) {}
+
+	void set(int p, const color& c)
+	{
+		for (int k = 0; k < 3; k++)
+			pixels[size_t(p) * 3 + k] = static_cast<float>(c[k]);
+	}
+	color get(int p) const
+	{
+		return color(pixels[size_t(p) * 3], pixels[size_t(p) * 3 + 1], pixels[size_t(p) * 3 + 2]);
+	}
+
+	const float* data() const { return pixels.data(); }
+
+	const int width, height;
+
+private:
+	std::vector<float> pixels;
+};
+
+// How tonemap() brings linear radiance into [0, 1] before gamma.
+enum class tonemap_operator
+{
+	clamp,		// cut off at 1, as the renderer always did
+	reinhard	// c / (1 + c) per channel, keeps highlights
+};
+
+// The LDR output stage: exposure, the operator, then gamma 2 and 8-bit
+// quantization exactly as the old per-pixel conversion did.
+inline std::vector<unsigned char> tonemap(const framebuffer& fb, tonemap_operator op = tonemap_operator::clamp,
+	double exposure = 1)
+{
+	std::vector<unsigned char> out(size_t(fb.width) * fb.height * 3);
+	for (int p = 0; p < fb.width * fb.height; p++)
+	{
+		auto c = fb.get(p);
+		for (int k = 0; k < 3; k++)
+		{
+			double v = c[k] * exposure;
+			if (op == tonemap_operator::reinhard)
+				v = v / (1 + v);
+			out[size_t(p) * 3 + k] = static_cast<unsigned char>(256 * clamp(sqrt(v), 0.0, 0.999));
+		}
+	}
+	return out;
+}
+
+namespace image_io
+{
+	inline void put_u32(std::vector<unsigned char>& out, uint32_t v)
+	{
+		for (int k = 0; k < 4; k++)
+			out.push_back(static_cast<unsigned char>(v >> (8 * k)));
+	}
+
+	inline void put_u64(std::vector<unsigned char>& out, uint64_t v)
+	{
+		for (int k = 0; k < 8; k++)
+			out.push_back(static_cast<unsigned char>(v >> (8 * k)));
+	}
+
+	inline void put_f32(std::vector<unsigned char>& out, float f)
+	{
+		uint32_t v;
+		memcpy(&v, &f, sizeof(v));
+		put_u32(out, v);
+	}
+
+	inline void put_str(std::vector<unsigned char>& out, const char* s)
+	{
+		out.insert(out.end(), s, s + strlen(s) + 1);
+	}
+
+	// IEEE half with round to nearest even; overflow goes to infinity.
+	inline uint16_t float_to_half(float f)
+	{
+		uint32_t x;
+		memcpy(&x, &f, sizeof(x));
+		uint32_t sign = (x >> 16) & 0x8000;
+		uint32_t mag = x & 0x7fffffff;
+
+		if (mag >= 0x7f800000)		// inf, nan
+			return static_cast<uint16_t>(sign | 0x7c00 | (mag > 0x7f800000 ? 0x200 : 0));
+		if (mag >= 0x477ff000)		// rounds past 65504
+			return static_cast<uint16_t>(sign | 0x7c00);
+		if (mag < 0x38800000)		// below the smallest normal half, 2^-14
+		{
+			if (mag < 0x33000000)	// at most half the smallest subnormal
+				return static_cast<uint16_t>(sign);
+			uint32_t m = (mag & 0x7fffff) | 0x800000;
+			int shift = 126 - static_cast<int>(mag >> 23);
+			uint32_t q = m >> shift;
+			uint32_t rest = m & ((1u << shift) - 1);
+			uint32_t halfway = 1u << (shift - 1);
+			if (rest > halfway || (rest == halfway && (q & 1)))
+				q++;
+			return static_cast<uint16_t>(sign | q);
+		}
+		uint32_t h = (mag - 0x38000000) >> 13;
+		uint32_t rest = mag & 0x1fff;
+		if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+			h++;
+		return static_cast<uint16_t>(sign | h);
+	}
+}
+
+// Reads a PFM as written by pfm_stream, in either byte order; an empty
+// (0 x 0) framebuffer if the file cannot be read. Grey (Pf) maps are not
+// supported.
+inline framebuffer read_pfm(const char* filename)
+{
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+		return framebuffer(0, 0);
+	int width, height;
+	float scale;
+	char c;
+	if (fscanf(f, "PF %d %d %f%c", &width, &height, &scale, &c) != 4 || width <= 0 || height <= 0)
+	{
+		fclose(f);
+		return framebuffer(0, 0);
+	}
+
+	const uint16_t probe = 1;
+	const bool swap = (scale < 0) != (*reinterpret_cast<const unsigned char*>(&probe) == 1);
+	framebuffer fb(width, height);
+	std::vector<float> row(size_t(width) * 3);
+	// Rows run from the bottom of the image.
+	for (int y = height - 1; y >= 0; y--)
+	{
+		if (fread(row.data(), sizeof(float), row.size(), f) != row.size())
+		{
+			fclose(f);
+			return framebuffer(0, 0);
+		}
+		for (size_t k = 0; swap && k < row.size(); k++)
+		{
+			unsigned char b[4];
+			memcpy(b, &row[k], 4);
+			std::swap(b[0], b[3]);
+			std::swap(b[1], b[2]);
+			memcpy(&row[k], b, 4);
+		}
+		for (int x = 0; x < width; x++)
+			fb.set(y * width + x, color(row[x * 3], row[x * 3 + 1], row[x * 3 + 2]));
+	}
+	fclose(f);
+	return fb;
+}
+
+// Root mean square difference of two same-sized images as displayed: each
+// channel clamped to [0, 1] and gamma 2, as tonemap() does before
+// quantizing. Lights and fireflies then count no more than any white pixel.
+inline double display_rmse(const framebuffer& a, const framebuffer& b)
+{
+	double sum = 0;
+	for (int p = 0; p < a.width * a.height; p++)
+	{
+		auto ca = a.get(p), cb = b.get(p);
+		for (int k = 0; k < 3; k++)
+		{
+			double d = sqrt(clamp(ca[k], 0.0, 1.0)) - sqrt(clamp(cb[k], 0.0, 1.0));
+			sum += d * d;
+		}
+	}
+	return sqrt(sum / (3.0 * a.width * a.height));
+}
+
+// Radiance RGBE through stb_image_write, row(y, rgb) filling the linear
+// RGB floats of row y (from the top) and returning false if it cannot.
+// stb encodes each row on its own, so the file goes out a row at a time:
+// each row is passed to stb as a one-row image, and the header stb writes
+// for it (its first two writes) is dropped in favour of the file's own.
+template <class F>
+bool write_hdr(const char* filename, int width, int height, F row)
+{
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+		return false;
+	struct sink
+	{
+		FILE* f;
+		int writes;
+		bool ok;
+	};
+	auto put = [](void* context, void* data, int size) {
+		auto& s = *static_cast<sink*>(context);
+		if (s.writes++ >= 2)
+			s.ok = s.ok && fwrite(data, 1, size_t(size), s.f) == size_t(size);
+	};
+
+	bool ok = fprintf(f, "#?RADIANCE\n# Written by stb_image_write.h\nFORMAT=32-bit_rle_rgbe\n"
+		"EXPOSURE=          1.0000000000000\n\n-Y %d +X %d\n", height, width) > 0;
+	std::vector<float> line(size_t(width) * 3);
+	for (int y = 0; ok && y < height; y++)
+	{
+		sink s{ f, 0, true };
+		ok = row(y, line.data()) && stbi_write_hdr_to_func(put, &s, width, 1, 3, line.data()) && s.ok;
+	}
+	return fclose(f) == 0 && ok;
+}
+
+inline bool write_hdr(const char* filename, const framebuffer& fb)
+{
+	return stbi_write_hdr(filename, fb.width, fb.height, 3, fb.data()) != 0;
+}
+
+// Minimal OpenEXR writer: half-float B, G, R channels, uncompressed, one
+// scanline per chunk. Enough for any EXR reader to load the linear image.
+// row(y, rgb) is as for write_hdr; each scanline is converted and written
+// as it is read.
+template <class F>
+bool write_exr(const char* filename, int width, int height, F row)
+{
+	using namespace image_io;
+	std::vector<unsigned char> out;
+	put_u32(out, 20000630);		// magic
+	put_u32(out, 2);			// version 2, single-part scanline
+
+	auto attribute = [&](const char* name, const char* type, uint32_t size) {
+		put_str(out, name);
+		put_str(out, type);
+		put_u32(out, size);
+	};
+
+	// Channels in alphabetical order, as the format requires.
+	attribute("channels", "chlist", 3 * 18 + 1);
+	for (const char* channel : { "B", "G", "R" })
+	{
+		put_str(out, channel);
+		put_u32(out, 1);			// HALF
+		put_u32(out, 0);			// pLinear and reserved bytes
+		put_u32(out, 1);			// x sampling
+		put_u32(out, 1);			// y sampling
+	}
+	out.push_back(0);
+	attribute("compression", "compression", 1);
+	out.push_back(0);				// NO_COMPRESSION
+	for (const char* window : { "dataWindow", "displayWindow" })
+	{
+		attribute(window, "box2i", 16);
+		put_u32(out, 0);
+		put_u32(out, 0);
+		put_u32(out, width - 1);
+		put_u32(out, height - 1);
+	}
+	attribute("lineOrder", "lineOrder", 1);
+	out.push_back(0);				// INCREASING_Y
+	attribute("pixelAspectRatio", "float", 4);
+	put_f32(out, 1);
+	attribute("screenWindowCenter", "v2f", 8);
+	put_f32(out, 0);
+	put_f32(out, 0);
+	attribute("screenWindowWidth", "float", 4);
+	put_f32(out, 1);
+	out.push_back(0);				// end of header
+
+	const uint32_t line_bytes = width * 3 * 2;
+	uint64_t offset = out.size() + uint64_t(height) * 8;
+	for (int y = 0; y < height; y++)
+	{
+		put_u64(out, offset);
+		offset += 8 + line_bytes;
+	}
+
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+		return false;
+	bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+	std::vector<float> line(size_t(width) * 3);
+	for (int y = 0; ok && y < height; y++)
+	{
+		ok = row(y, line.data());
+		out.clear();
+		put_u32(out, y);
+		put_u32(out, line_bytes);
+		for (int k : { 2, 1, 0 })
+		{
+			for (int x = 0; x < width; x++)
+			{
+				auto h = float_to_half(line[size_t(x) * 3 + k]);
+				out.push_back(static_cast<unsigned char>(h));
+				out.push_back(static_cast<unsigned char>(h >> 8));
+			}
+		}
+		ok = ok && fwrite(out.data(), 1, out.size(), f) == out.size();
+	}
+	return fclose(f) == 0 && ok;
+}
+
+inline bool write_exr(const char* filename, const framebuffer& fb)
+{
+	return write_exr(filename, fb.width, fb.height, [&](int y, float* rgb) {
+		memcpy(rgb, fb.data() + size_t(y) * fb.width * 3, size_t(fb.width) * 3 * sizeof(float));
+		return true;
+	});
+}
+
+// An image box-filtered down by a whole factor until neither side exceeds
+// max_size, built up one source pixel at a time. A streaming render makes
+// its JPEG and spp heatmap from these instead of full-size buffers.
+class reduced_image
+{
+public:
+	reduced_image(int source_width, int source_height, int max_size)
+		: factor(std::max((std::max(source_width, source_height) + max_size - 1) / max_size, 1)),
+		  width((source_width + factor - 1) / factor), height((source_height + factor - 1) / factor),
+		  sums(size_t(width) * height, color(0, 0, 0)), counts(size_t(width) * height) {}
+
+	void add(int x, int y, const color& c)
+	{
+		size_t p = size_t(y / factor) * width + x / factor;
+		sums[p] += c;
+		counts[p]++;
+	}
+
+	// The mean of each block.
+	framebuffer image() const
+	{
+		framebuffer fb(width, height);
+		for (size_t p = 0; p < sums.size(); p++)
+			fb.set(int(p), counts[p] ? sums[p] / counts[p] : color(0, 0, 0));
+		return fb;
+	}
+
+	const int factor, width, height;
+
+private:
+	std::vector<color> sums;
+	std::vector<int> counts;
+};
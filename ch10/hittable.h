@@ -1,9 +1,22 @@
 #pragma once
 #include "ray.h"
 #include "aabb.h"
+#include "ray_packet.h"
+#include "arena.h"
+#include <vector>
 class material;
+class hittable;
 
-void get_sphere_uv(const vec3& p, double& u, double& v)
+// Emitters gathered by hittable::collect_lights(). One inside an instance
+// transform is listed as a copy of the transform around just that emitter;
+// instances keeps those copies alive.
+struct light_collection
+{
+	std::vector<const hittable*> lights;
+	std::vector<shared_ptr<hittable>> instances;
+};
+
+void get_sphere_uv(const vec3& p, real& u, real& v)
 {
 	//auto phi = atan2(p.z(), p.x());
 	//auto theta = acos(p.y());
@@ -20,10 +33,19 @@ struct hit_record
 {
 	point3 p;
 	vec3 normal;
-	shared_ptr<material> mat_ptr;
-	double t;
-	double u;
-	double v;
+	// Not owning: the primitive that was hit keeps its material alive, so
+	// copying a record on the hot path costs no reference counting.
+	const material* mat_ptr;
+	// Set by hit_deferred() when the attributes above are still to be
+	// filled in by this primitive's complete(); null once they are.
+	const hittable* object = nullptr;
+	real t;
+	real u;
+	real v;
+	// Change of (u, v) per unit of distance on the surface (the geometric
+	// mean of the two rates), to turn a ray cone's width into a texture
+	// footprint. Zero where it is not known.
+	real uv_scale = 0;
 	bool front_face;
 	inline void set_face_normal(const ray& r, const vec3& outward_normal)
 	{
@@ -32,26 +54,155 @@ struct hit_record
 	}
 };
 
+// What hit_packet() found for each lane of a ray_packet, besides the t it
+// leaves in the packet. A lane is normally completed afterwards by tracing
+// object[i] alone up to that t, which finds the same hit: the primitive or
+// transform with a packet form that lowered it last names itself here, not
+// the aggregates above it. Lanes traced one at a time have their full record
+// in rec[i], the caller's, instead, marked in recorded; they run with
+// streams[i] as their random stream (when given), as they would have outside
+// the packet.
+struct packet_hits
+{
+	const hittable* object[ray_packet::width];
+	hit_record* rec;
+	int recorded = 0;
+	pcg32* streams = nullptr;
+
+	// Names by as the object that completes the lanes of lowered; returns them.
+	int lowered_by(const hittable* by, int lowered)
+	{
+		if (!lowered)
+			return 0;
+		for (int i = 0; i < ray_packet::width; i++)
+			object[i] = (lowered >> i) & 1 ? by : object[i];
+		recorded &= ~lowered;
+		return lowered;
+	}
+};
+
 class hittable
 {
 public:
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
-	virtual bool bounding_box(double t0, double t1, aabb& output_box) const = 0;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const = 0;
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const = 0;
+
+	// Closest hit for aggregates, which may overwrite many candidates before
+	// settling: a primitive can record just t and itself as rec.object and
+	// leave p, normal, front_face, uv and material to complete(), called
+	// once for the final hit with the same ray. The default is hit().
+	virtual bool hit_deferred(const ray& r, real t_min, real t_max, hit_record& rec) const
+	{
+		if (!hit(r, t_min, t_max, rec))
+			return false;
+		rec.object = nullptr;
+		return true;
+	}
+	virtual void complete(const ray& r, hit_record& rec) const {}
+
+	// Traces the lanes of p in mask, lowering p.t_max for each lane that
+	// finds a closer hit; returns those lanes. Only objects whose
+	// traces_packets() is true test the packet as a whole, and they record
+	// no more than packet_hits::lowered_by() in hits: their hits are
+	// deterministic and the caller completes them by tracing again.
+	// Aggregates leave that to their members. The default traces one lane
+	// at a time.
+	virtual int hit_packet(ray_packet& p, int mask, packet_hits& hits) const;
+	virtual bool traces_packets() const { return false; }
+
+	// Whether anything lies on r within (t_min, t_max). Shadow rays only
+	// need the answer; the default finds the closest hit to get it.
+	virtual bool occluded(const ray& r, real t_min, real t_max) const
+	{
+		hit_record rec;
+		return hit(r, t_min, t_max, rec);
+	}
+
+	// Light sampling, for the emitters that support it: random(o) points
+	// from o towards a random point of the surface, and pdf_value(o, v) is
+	// the solid-angle density with which it picks direction v.
+	virtual real pdf_value(const point3& o, const vec3& v) const { return 0; }
+	virtual vec3 random(const point3& o) const { return vec3(1, 0, 0); }
+
+	// Adds the emitters that can be sampled directly to out. Aggregates and
+	// transforms pass the call on to what they hold.
+	virtual void collect_lights(light_collection& out) const {}
 };
 
+int hittable::hit_packet(ray_packet& p, int mask, packet_hits& hits) const
+{
+	int lowered = 0;
+	for (int i = 0; i < p.size; i++)
+	{
+		if (!((mask >> i) & 1))
+			continue;
+		if (hits.streams)
+			std::swap(random_generator(), hits.streams[i]);
+		hit_record rec;
+		bool hit = this->hit(p.get(i), p.t_min, p.t_max[i], rec);
+		if (hits.streams)
+			std::swap(random_generator(), hits.streams[i]);
+		if (hit)
+		{
+			p.t_max[i] = rec.t;
+			hits.rec[i] = rec;
+			hits.recorded |= 1 << i;
+			lowered |= 1 << i;
+		}
+	}
+	return lowered;
+}
+
+// Closest hit of every ray of p in world, as world.hit() would find it for
+// each alone; returns the lanes that hit, whose records are in rec. Each
+// lane is completed once, at the end.
+inline int hit_packet(const hittable& world, ray_packet& p, pcg32* streams, hit_record* rec)
+{
+	packet_hits hits;
+	hits.rec = rec;
+	hits.streams = streams;
+	int lowered = world.hit_packet(p, p.all(), hits);
+	int pending = lowered & ~hits.recorded;
+	for (int i = 0; i < p.size; i++)
+	{
+		// hit() keeps t < t_max for some primitives, so allow t itself.
+		if ((pending >> i) & 1)
+			hits.object[i]->hit(p.get(i), p.t_min, std::nextafter(p.t_max[i], infinity), rec[i]);
+	}
+	return lowered;
+}
+
+// Fills in the attributes hit_deferred() left for later, if any.
+inline void complete_hit(const ray& r, hit_record& rec)
+{
+	if (rec.object)
+	{
+		rec.object->complete(r, rec);
+		rec.object = nullptr;
+	}
+}
+
 class flip_face : public hittable
 {
 public:
 	flip_face(shared_ptr<hittable> p) : ptr(p) {}
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 	{
 		if (!ptr->hit(r, t_min, t_max, rec))
 			return false;
 		rec.front_face = !rec.front_face;
 		return true;
 	}
+	virtual bool occluded(const ray& r, real t_min, real t_max) const
+	{
+		return ptr->occluded(r, t_min, t_max);
+	}
+	virtual void collect_lights(light_collection& out) const
+	{
+		ptr->collect_lights(out);
+	}
 
-	virtual bool bounding_box(double t0, double t1, aabb& output_box) const
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const
 	{
 		return ptr->bounding_box(t0, t1, output_box);
 	}
@@ -60,19 +211,35 @@ public:
 	shared_ptr<hittable> ptr;
 };
 
+template <> struct arena_allocatable<flip_face> : std::true_type {};
+
 class translate : public hittable
 {
 public:
 	translate(shared_ptr<hittable> p, const vec3& displacement) : ptr(p), offset(displacement) {}
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
-	virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
+	virtual int hit_packet(ray_packet& p, int mask, packet_hits& hits) const;
+	virtual bool traces_packets() const { return packets; }
+	virtual bool occluded(const ray& r, real t_min, real t_max) const
+	{
+		return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+	}
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const;
+	virtual real pdf_value(const point3& o, const vec3& v) const { return ptr->pdf_value(o - offset, v); }
+	virtual vec3 random(const point3& o) const { return ptr->random(o - offset); }
+	virtual void collect_lights(light_collection& out) const;
 
 public:
 	shared_ptr<hittable> ptr;
 	vec3 offset;
+
+private:
+	bool packets = ptr->traces_packets();
 };
 
-bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+template <> struct arena_allocatable<translate> : std::true_type {};
+
+bool translate::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
 	ray moved_r(r.origin() - offset, r.direction(), r.time());
 	if (!ptr->hit(moved_r, t_min, t_max, rec))
@@ -83,7 +250,54 @@ bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) c
 	return true;
 }
 
-bool translate::bounding_box(double t0, double t1, aabb& output_box) const
+// Moves the packet into the child's frame, as hit() moves a ray, and back
+// again afterwards. The origins are restored from a copy, since adding the
+// offset back need not round to them. Rounding is monotonic, so the moved
+// ranges are the old ones moved.
+int translate::hit_packet(ray_packet& p, int mask, packet_hits& hits) const
+{
+	if (!packets)
+		return hittable::hit_packet(p, mask, hits);
+	alignas(32) real o[3][ray_packet::width];
+	real o_lo[3], o_hi[3];
+	for (int a = 0; a < 3; a++)
+	{
+		for (int i = 0; i < ray_packet::width; i++)
+		{
+			o[a][i] = p.o[a][i];
+			p.o[a][i] = o[a][i] - offset[a];
+		}
+		o_lo[a] = p.o_lo[a];
+		o_hi[a] = p.o_hi[a];
+		p.o_lo[a] = o_lo[a] - offset[a];
+		p.o_hi[a] = o_hi[a] - offset[a];
+	}
+	int lowered = ptr->hit_packet(p, mask, hits);
+	for (int a = 0; a < 3; a++)
+	{
+		for (int i = 0; i < ray_packet::width; i++)
+			p.o[a][i] = o[a][i];
+		p.o_lo[a] = o_lo[a];
+		p.o_hi[a] = o_hi[a];
+	}
+	return hits.lowered_by(this, lowered);
+}
+
+// Each emitter inside is listed as a translate of just that emitter, which
+// shares ownership of ptr.
+void translate::collect_lights(light_collection& out) const
+{
+	light_collection inner;
+	ptr->collect_lights(inner);
+	for (const auto* light : inner.lights)
+	{
+		out.instances.push_back(std::make_shared<translate>(shared_ptr<hittable>(ptr, const_cast<hittable*>(light)), offset));
+		out.lights.push_back(out.instances.back().get());
+	}
+	out.instances.insert(out.instances.end(), inner.instances.begin(), inner.instances.end());
+}
+
+bool translate::bounding_box(real t0, real t1, aabb& output_box) const
 {
 	if (!ptr->bounding_box(t0, t1, output_box))
 		return false;
@@ -94,27 +308,58 @@ bool translate::bounding_box(double t0, double t1, aabb& output_box) const
 class rotate_y : public hittable
 {
 public:
-	rotate_y(shared_ptr<hittable> p, double angle);
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
-	virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
+	rotate_y(shared_ptr<hittable> p, real angle);
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
+	virtual int hit_packet(ray_packet& p, int mask, packet_hits& hits) const;
+	virtual bool traces_packets() const { return packets; }
+	virtual bool occluded(const ray& r, real t_min, real t_max) const
+	{
+		return ptr->occluded(to_object(r), t_min, t_max);
+	}
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const {
 		output_box = bbox;
 		return hasbox;
 	}
+	virtual real pdf_value(const point3& o, const vec3& v) const
+	{
+		return ptr->pdf_value(to_object(o), to_object(v));
+	}
+	virtual vec3 random(const point3& o) const { return to_world(ptr->random(to_object(o))); }
+	virtual void collect_lights(light_collection& out) const;
 
 public:
 	shared_ptr<hittable> ptr;
-	double sin_theta;
-	double cos_theta;
+	real angle;		// degrees
+	real sin_theta;
+	real cos_theta;
 	bool hasbox;
 	aabb bbox;
+
+private:
+	bool packets;
+
+	// r rotated into the child's frame.
+	ray to_object(const ray& r) const;
+	// A point or direction rotated into the child's frame, and back.
+	vec3 to_object(const vec3& v) const
+	{
+		return vec3(cos_theta * v[0] - sin_theta * v[2], v[1], sin_theta * v[0] + cos_theta * v[2]);
+	}
+	vec3 to_world(const vec3& v) const
+	{
+		return vec3(cos_theta * v[0] + sin_theta * v[2], v[1], -sin_theta * v[0] + cos_theta * v[2]);
+	}
 };
 
-rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p)
+template <> struct arena_allocatable<rotate_y> : std::true_type {};
+
+rotate_y::rotate_y(shared_ptr<hittable> p, real angle) : ptr(p), angle(angle)
 {
 	auto radians = degrees_to_radians(angle);
 	sin_theta = sin(radians);
 	cos_theta = cos(radians);
 	hasbox = ptr->bounding_box(0, 1, bbox);
+	packets = ptr->traces_packets();
 
 	point3 min(infinity, infinity, infinity);
 	point3 max(-infinity, -infinity, -infinity);
@@ -141,7 +386,7 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p)
 	bbox = aabb(min, max);
 }
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+ray rotate_y::to_object(const ray& r) const
 {
 	auto origin = r.origin();
 	auto direction = r.direction();
@@ -152,7 +397,12 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
 	direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
 
-	ray rotated_r(origin, direction, r.time());
+	return ray(origin, direction, r.time());
+}
+
+bool rotate_y::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	ray rotated_r = to_object(r);
 
 	if (!ptr->hit(rotated_r, t_min, t_max, rec))
 		return false;
@@ -169,4 +419,92 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	rec.set_face_normal(rotated_r, normal);
 
 	return true;
-};
+}
+
+// Rotates the packet into the child's frame, as to_object() does a ray,
+// unless it misses the rotated bounds altogether. The bounds come from
+// rotated corners and may round inside a hit found in the child's frame, so
+// they are widened a little first.
+int rotate_y::hit_packet(ray_packet& p, int mask, packet_hits& hits) const
+{
+	if (!packets)
+		return hittable::hit_packet(p, mask, hits);
+	if (hasbox)
+	{
+		real lo[3], hi[3];
+		for (int a = 0; a < 3; a++)
+		{
+			lo[a] = bbox.min()[a] - real(1e-4) * (fabs(bbox.min()[a]) + 1);
+			hi[a] = bbox.max()[a] + real(1e-4) * (fabs(bbox.max()[a]) + 1);
+		}
+		if (!p.may_hit(lo, hi, mask))
+			return 0;
+	}
+	// x and z change; they are put back from a copy afterwards.
+	struct axis
+	{
+		alignas(32) real o[ray_packet::width], d[ray_packet::width], inv[ray_packet::width];
+		real o_lo, o_hi, inv_lo, inv_hi;
+		int sign;
+		bool coherent;
+	} saved[2];
+	for (int k = 0; k < 2; k++)
+	{
+		int a = 2 * k;
+		for (int i = 0; i < ray_packet::width; i++)
+		{
+			saved[k].o[i] = p.o[a][i];
+			saved[k].d[i] = p.d[a][i];
+			saved[k].inv[i] = p.inv[a][i];
+		}
+		saved[k].o_lo = p.o_lo[a];
+		saved[k].o_hi = p.o_hi[a];
+		saved[k].inv_lo = p.inv_lo[a];
+		saved[k].inv_hi = p.inv_hi[a];
+		saved[k].sign = p.sign[a];
+		saved[k].coherent = p.axis_coherent[a];
+	}
+	for (int i = 0; i < ray_packet::width; i++)
+	{
+		p.o[0][i] = cos_theta * saved[0].o[i] - sin_theta * saved[1].o[i];
+		p.o[2][i] = sin_theta * saved[0].o[i] + cos_theta * saved[1].o[i];
+		p.d[0][i] = cos_theta * saved[0].d[i] - sin_theta * saved[1].d[i];
+		p.d[2][i] = sin_theta * saved[0].d[i] + cos_theta * saved[1].d[i];
+		p.inv[0][i] = 1 / p.d[0][i];
+		p.inv[2][i] = 1 / p.d[2][i];
+	}
+	p.bound_axis(0);
+	p.bound_axis(2);
+	int lowered = ptr->hit_packet(p, mask, hits);
+	for (int k = 0; k < 2; k++)
+	{
+		int a = 2 * k;
+		for (int i = 0; i < ray_packet::width; i++)
+		{
+			p.o[a][i] = saved[k].o[i];
+			p.d[a][i] = saved[k].d[i];
+			p.inv[a][i] = saved[k].inv[i];
+		}
+		p.o_lo[a] = saved[k].o_lo;
+		p.o_hi[a] = saved[k].o_hi;
+		p.inv_lo[a] = saved[k].inv_lo;
+		p.inv_hi[a] = saved[k].inv_hi;
+		p.sign[a] = saved[k].sign;
+		p.axis_coherent[a] = saved[k].coherent;
+	}
+	p.coherent = p.axis_coherent[0] && p.axis_coherent[1] && p.axis_coherent[2];
+	return hits.lowered_by(this, lowered);
+}
+
+// As translate::collect_lights.
+void rotate_y::collect_lights(light_collection& out) const
+{
+	light_collection inner;
+	ptr->collect_lights(inner);
+	for (const auto* light : inner.lights)
+	{
+		out.instances.push_back(std::make_shared<rotate_y>(shared_ptr<hittable>(ptr, const_cast<hittable*>(light)), angle));
+		out.lights.push_back(out.instances.back().get());
+	}
+	out.instances.insert(out.instances.end(), inner.instances.begin(), inner.instances.end());
+}
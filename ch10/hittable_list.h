@@ -1,5 +1,6 @@
 #pragma once
 #include "hittable.h"
+#include "arena.h"
 #include <memory>
 #include <vector>
 
@@ -16,11 +17,59 @@ public:
 	void clear() { objects.clear(); }
 	void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
-	virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
-
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+	{
+		if (!hit_deferred(r, t_min, t_max, rec))
+			return false;
+		complete_hit(r, rec);
+		return true;
+	}
+	virtual bool hit_deferred(const ray& r, real t_min, real t_max, hit_record& rec) const;
+	virtual int hit_packet(ray_packet& p, int mask, packet_hits& hits) const
+	{
+		int lowered = 0;
+		for (const auto& object : objects)
+			lowered |= object->hit_packet(p, mask, hits);
+		return lowered;
+	}
+	virtual bool traces_packets() const
+	{
+		for (const auto& object : objects)
+		{
+			if (!object->traces_packets())
+				return false;
+		}
+		return true;
+	}
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const;
+	virtual bool occluded(const ray& r, real t_min, real t_max) const
+	{
+		for (const auto& object : objects)
+		{
+			if (object->occluded(r, t_min, t_max))
+				return true;
+		}
+		return false;
+	}
+	virtual void collect_lights(light_collection& out) const
+	{
+		for (const auto& object : objects)
+			object->collect_lights(out);
+	}
 };
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+
+// A list is not arena_allocatable, but objects built from one (bvh_node)
+// keep its members.
+inline bool arena_held(const hittable_list& list)
+{
+	for (const auto& object : list.objects)
+	{
+		if (!arena_held(object))
+			return false;
+	}
+	return true;
+}
+bool hittable_list::hit_deferred(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
 	hit_record temp_rec;
 	bool hit_anything = false;
@@ -28,7 +77,7 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
 
 	for (const auto& object : objects)
 	{
-		if (object->hit(r, t_min, closest_so_far, temp_rec))
+		if (object->hit_deferred(r, t_min, closest_so_far, temp_rec))
 		{
 			hit_anything = true;
 			closest_so_far = temp_rec.t;
@@ -37,7 +86,7 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
 	}
 	return hit_anything;
 }
-bool hittable_list::bounding_box(double t0, double t1, aabb& output_box) const
+bool hittable_list::bounding_box(real t0, real t1, aabb& output_box) const
 {
 	if (objects.empty())
 		return false;
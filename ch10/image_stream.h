@@ -0,0 +1,173 @@
+#pragma once
+#include "rtweekend.h"
+#include "scheduler.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// A PFM file created at full size up front, whose pixels are written in place
+// as tiles finish. Nothing of the image is buffered: every tile goes straight
+// into the memory-mapped file, so other processes can read finished regions
+// while the render is still running. Where mapping is not available (Windows,
+// or a failed mmap) each tile row is written with a seek and fwrite instead.
+class pfm_stream
+{
+public:
+	pfm_stream(const std::string& filename, int width, int height) : width(width), height(height)
+	{
+		// Floats are stored in host order; the sign of the scale says which.
+		const uint16_t probe = 1;
+		const bool little = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+		char header[64];
+		header_size = snprintf(header, sizeof(header), "PF\n%d %d\n%s\n", width, height, little ? "-1.0" : "1.0");
+		const size_t size = header_size + size_t(width) * height * 3 * sizeof(float);
+
+#ifndef _WIN32
+		fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd >= 0 && ftruncate(fd, size) == 0)
+		{
+			void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED)
+			{
+				mapped = static_cast<unsigned char*>(p);
+				mapped_size = size;
+				memcpy(mapped, header, header_size);
+				return;
+			}
+		}
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+#endif
+		file = fopen(filename.c_str(), "wb+");
+		if (!file)
+			return;
+		fwrite(header, 1, header_size, file);
+		// Extend to the full size so unwritten tiles read as black.
+		if (size > header_size)
+		{
+			seek(size - 1);
+			fputc(0, file);
+		}
+	}
+
+	~pfm_stream()
+	{
+#ifndef _WIN32
+		if (mapped)
+		{
+			munmap(mapped, mapped_size);
+			close(fd);
+		}
+#endif
+		if (file)
+			fclose(file);
+	}
+
+	pfm_stream(const pfm_stream&) = delete;
+	pfm_stream& operator=(const pfm_stream&) = delete;
+
+	bool is_open() const { return mapped || file; }
+
+	// Writes the pixels of t, pixel_color(p) giving the linear color of
+	// image pixel p (rows from the top). Tiles may be written concurrently.
+	template <class F>
+	void write_tile(const tile& t, F pixel_color)
+	{
+		float row[3 * 256];
+		for (int y = t.y0; y < t.y1; y++)
+		{
+			// PFM rows run from the bottom of the image.
+			const size_t offset = header_size + (size_t(height - 1 - y) * width + t.x0) * 3 * sizeof(float);
+			for (int x0 = t.x0; x0 < t.x1; x0 += 256)
+			{
+				int n = std::min(t.x1 - x0, 256);
+				for (int i = 0; i < n; i++)
+				{
+					auto c = pixel_color(y * width + x0 + i);
+					for (int k = 0; k < 3; k++)
+						row[i * 3 + k] = static_cast<float>(c[k]);
+				}
+				write(offset + size_t(x0 - t.x0) * 3 * sizeof(float), row, n * 3 * sizeof(float));
+			}
+		}
+	}
+
+	// Reads back row y (from the top) as width RGB floats; false if the
+	// file could not be opened or read.
+	bool read_row(int y, float* rgb)
+	{
+		const size_t offset = header_size + size_t(height - 1 - y) * width * 3 * sizeof(float);
+		const size_t bytes = size_t(width) * 3 * sizeof(float);
+		if (mapped)
+		{
+			memcpy(rgb, mapped + offset, bytes);
+			return true;
+		}
+		if (!file)
+			return false;
+		std::lock_guard<std::mutex> lock(file_mutex);
+		seek(offset);
+		return fread(rgb, 1, bytes, file) == bytes;
+	}
+
+	// Pushes everything written so far to the file.
+	void flush()
+	{
+#ifndef _WIN32
+		if (mapped)
+		{
+			msync(mapped, mapped_size, MS_ASYNC);
+			return;
+		}
+#endif
+		if (file)
+		{
+			std::lock_guard<std::mutex> lock(file_mutex);
+			fflush(file);
+		}
+	}
+
+	const int width, height;
+
+private:
+	void write(size_t offset, const float* values, size_t bytes)
+	{
+		if (mapped)
+		{
+			memcpy(mapped + offset, values, bytes);
+			return;
+		}
+		if (!file)
+			return;
+		std::lock_guard<std::mutex> lock(file_mutex);
+		seek(offset);
+		fwrite(values, 1, bytes, file);
+	}
+
+	// Large frames pass 2 GiB, beyond what fseek's long reaches on Windows.
+	void seek(size_t offset)
+	{
+#ifdef _WIN32
+		_fseeki64(file, static_cast<long long>(offset), SEEK_SET);
+#else
+		fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+	}
+
+	size_t header_size = 0;
+	unsigned char* mapped = nullptr;
+	size_t mapped_size = 0;
+	int fd = -1;
+	FILE* file = nullptr;
+	std::mutex file_mutex;
+};
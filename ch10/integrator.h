@@ -0,0 +1,148 @@
+#pragma once
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+#include "lights.h"
+#include "thread_counters.h"
+
+// Which path tracer main() renders with.
+enum class integrator_type
+{
+	recursive,	// ray_color, fixed max_depth
+	iterative,	// ray_color_iterative, Russian roulette after rr_start_depth bounces
+	wavefront	// wavefront_renderer: ray_color_iterative one bounce at a time over many paths
+};
+
+// Path counters for one render; see thread_counters.
+struct path_stats : thread_counters<path_stats>
+{
+	long long paths = 0;
+	long long segments = 0;		// rays traced against the scene
+	long long terminated = 0;	// paths ended by Russian roulette
+	long long shadow_rays = 0;	// light samples tested for occlusion
+
+	double average_length() const { return paths ? double(segments) / paths : 0.0; }
+
+	void add(const path_stats& other)
+	{
+		paths += other.paths;
+		segments += other.segments;
+		terminated += other.terminated;
+		shadow_rays += other.shadow_rays;
+	}
+};
+
+const int rr_start_depth = 5;
+
+inline real power_heuristic(real f, real g)
+{
+	return f * f / (f * f + g * g);
+}
+
+// Next-event estimation at a diffuse hit rec, reached along r_in. Returns
+// the radiance of one light sample per unit of the material's attenuation,
+// MIS-weighted against scatter() finding the same light.
+inline color sample_light(const light_list& lights, const hittable& world, const ray& r_in, const hit_record& rec)
+{
+	vec3 to_light = lights.random(rec.p);
+	ray shadow(rec.p, to_light, r_in.time());
+	hit_record light_rec;
+	if (!lights.hit(shadow, light_rec))
+		return color(0, 0, 0);
+	auto light_pdf = lights.pdf_value(rec.p, to_light);
+	auto scatter_pdf = rec.mat_ptr->scattering_pdf(r_in, rec, to_light);
+	if (light_pdf <= 0 || scatter_pdf <= 0)
+		return color(0, 0, 0);
+	// Stop just short of the light, which is part of the world too.
+	path_stats::local().shadow_rays++;
+	if (world.occluded(shadow, 0.001, light_rec.t * real(1 - 1e-4)))
+		return color(0, 0, 0);
+	auto emitted = light_rec.mat_ptr->emitted(light_rec.u, light_rec.v, light_rec.p);
+	return emitted * (scatter_pdf * power_heuristic(light_pdf, scatter_pdf) / light_pdf);
+}
+
+// MIS weight of emission hit at rec along r, scattered with density
+// scatter_pdf from a hit that also sampled the lights (scatter_pdf > 0).
+// An emitter that is not in the list was never sampled, so scattering is
+// its only estimate and keeps the full weight.
+inline real emission_weight(const light_list& lights, const ray& r, const hit_record& rec, real scatter_pdf)
+{
+	if (!lights.listed(r, rec))
+		return 1;
+	return power_heuristic(scatter_pdf, lights.pdf_value(r.origin(), r.direction()));
+}
+
+// Same expected radiance as ray_color, but carries the path throughput
+// through a loop instead of recursing. After rr_start_depth bounces a path
+// survives with probability max(throughput) and is reweighted by its
+// inverse, so dim paths stop early without biasing the estimate.
+//
+// With lights, diffuse hits also sample a light directly (next-event
+// estimation) and both that and emission found by scattering are weighted
+// by the power heuristic, so small lights converge far sooner.
+//
+// This form starts from a camera ray that was already traced, as part of a
+// ray_packet: hit says whether it found first_rec.
+color ray_color_iterative(const ray& r, bool hit, const hit_record& first_rec,
+	const color& background, const hittable& world, int max_depth, const light_list* lights = nullptr)
+{
+	auto& stats = path_stats::local();
+	if (lights && lights->empty())
+		lights = nullptr;
+	color radiance(0, 0, 0);
+	color throughput(1, 1, 1);
+	ray current = r;
+	hit_record rec = first_rec;
+	real scatter_pdf = 0;	// density current was scattered with, if the lights were sampled too
+
+	for (int bounce = 0; bounce < max_depth; bounce++)
+	{
+		stats.segments++;
+		if (bounce > 0)
+		{
+			rec = hit_record();
+			hit = world.hit(current, 0.001, infinity, rec);
+		}
+		if (!hit)
+		{
+			radiance += throughput * background;
+			break;
+		}
+
+		ray scattered;
+		color attenuation;
+		auto emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+		if (scatter_pdf > 0 && emitted.length_squared() > 0)
+			emitted *= emission_weight(*lights, current, rec, scatter_pdf);
+		radiance += throughput * emitted;
+		if (!rec.mat_ptr->scatter(current, rec, attenuation, scattered))
+			break;
+		scatter_pdf = lights ? rec.mat_ptr->scattering_pdf(current, rec, scattered.direction()) : 0;
+		if (scatter_pdf > 0)
+			radiance += throughput * attenuation * sample_light(*lights, world, current, rec);
+		throughput = throughput * attenuation;
+
+		if (bounce + 1 >= rr_start_depth)
+		{
+			auto survive = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 0.95);
+			if (random_double() >= survive)
+			{
+				stats.terminated++;
+				break;
+			}
+			throughput /= survive;
+		}
+		current = scattered;
+	}
+	return radiance;
+}
+
+color ray_color_iterative(const ray& r, const color& background, const hittable& world, int max_depth,
+	const light_list* lights = nullptr)
+{
+	if (max_depth <= 0)
+		return color(0, 0, 0);
+	hit_record rec;
+	bool hit = world.hit(r, 0.001, infinity, rec);
+	return ray_color_iterative(r, hit, rec, background, world, max_depth, lights);
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include "hittable.h"
+#include <vector>
+
+// The emitters next-event estimation samples, gathered from the scene once
+// it is built (hittable::collect_lights) through lists, bvhs and instance
+// transforms. Emitters of kinds that cannot be sampled (boxes, moving
+// spheres) are left out and only found by scattered rays.
+class light_list
+{
+public:
+	light_list() {}
+	explicit light_list(const hittable& world)
+	{
+		light_collection found;
+		world.collect_lights(found);
+		lights = std::move(found.lights);
+		instances = std::move(found.instances);
+	}
+
+	bool empty() const { return lights.empty(); }
+
+	// Direction from o to a random point of a light chosen uniformly.
+	vec3 random(const point3& o) const
+	{
+		return lights[random_int(0, static_cast<int>(lights.size()) - 1)]->random(o);
+	}
+
+	// Solid-angle density with which random(o) returns direction v.
+	real pdf_value(const point3& o, const vec3& v) const
+	{
+		real sum = 0;
+		for (const auto* light : lights)
+			sum += light->pdf_value(o, v);
+		return sum / lights.size();
+	}
+
+	// The closest light along r.
+	bool hit(const ray& r, hit_record& rec) const
+	{
+		hit_record temp_rec;
+		bool hit_anything = false;
+		auto closest_so_far = infinity;
+		for (const auto* light : lights)
+		{
+			if (light->hit(r, 0.001, closest_so_far, temp_rec))
+			{
+				hit_anything = true;
+				closest_so_far = temp_rec.t;
+				rec = temp_rec;
+			}
+		}
+		return hit_anything;
+	}
+
+	// Whether rec, the closest hit along r, lies on one of the lights. Only
+	// then could next-event estimation have found the same emission.
+	bool listed(const ray& r, const hit_record& rec) const
+	{
+		hit_record light_rec;
+		return hit(r, light_rec) && light_rec.mat_ptr == rec.mat_ptr && fabs(light_rec.t - rec.t) <= 1e-4 * rec.t;
+	}
+
+	std::vector<const hittable*> lights;
+
+private:
+	std::vector<shared_ptr<hittable>> instances;	// see light_collection
+};
@@ -0,0 +1,377 @@
+#pragma once
+#include "bvh.h"
+#include <cstdint>
+
+// One node of a flattened BVH. Nodes are stored depth first, so an interior
+// node's first child directly follows it and only the second child's index
+// needs to be kept.
+struct linear_bvh_node
+{
+	float bounds_min[3];
+	float bounds_max[3];
+	int32_t offset;		// leaf: first primitive; interior: second child
+	uint16_t count;		// primitives in the leaf, 0 for interior nodes
+	uint8_t axis;		// split axis, picks the near child during traversal
+	uint8_t flip;		// set when the second child lies below the first on axis
+
+	bool is_leaf() const { return count > 0; }
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should fill half a cache line");
+
+// A pointer-free BVH: one contiguous node array plus the primitives in leaf
+// order, traversed with an explicit stack instead of virtual calls per node.
+class linear_bvh : public hittable
+{
+public:
+	static const int max_leaf_size = 4;
+	static const int stack_size = 64;	// on the call stack; deeper trees use the heap
+
+	// Builds directly from the list with the binned SAH split from bvh_node.
+	linear_bvh(const hittable_list& list, real time0, real time1);
+
+	// Flattens an existing bvh_node tree, keeping its shape.
+	linear_bvh(const bvh_node& root, real time0, real time1);
+
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+	{
+		if (!hit_deferred(r, t_min, t_max, rec))
+			return false;
+		complete_hit(r, rec);
+		return true;
+	}
+	virtual bool hit_deferred(const ray& r, real t_min, real t_max, hit_record& rec) const;
+	virtual bool occluded(const ray& r, real t_min, real t_max) const;
+	virtual int hit_packet(ray_packet& p, int mask, packet_hits& hits) const;
+	virtual bool traces_packets() const { return packets; }
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const;
+	virtual void collect_lights(light_collection& out) const
+	{
+		for (const auto& primitive : primitives)
+			primitive->collect_lights(out);
+	}
+
+	size_t memory_bytes() const { return nodes.size() * sizeof(linear_bvh_node); }
+
+public:
+	std::vector<linear_bvh_node> nodes;
+	std::vector<shared_ptr<hittable>> primitives;
+	aabb box;
+	int depth = 0;		// interior nodes above the deepest leaf, the most a traversal stacks
+
+private:
+	bool packets = true;	// whether every primitive traces packets
+
+	// traverse() for the lanes of mask of p, which share the direction signs
+	// neg: a node is entered if may_hit() lets it through and box_mask()
+	// finds lanes in it, and leaf(first, last, lanes) gets those lanes.
+	template <class F>
+	void traverse_packet(const ray_packet& p, int mask, const int neg[3], F leaf) const;
+
+	// Calls leaf(first, last) for every leaf whose box r overlaps within
+	// (t_min, t_max), near child first; returning true stops the walk.
+	// t_max is re-read at each node, so leaf may lower it through a
+	// reference to find the closest hit.
+	template <class F>
+	void traverse(const ray& r, real t_min, const real& t_max, F leaf) const;
+
+	int build(size_t start, size_t end, real time0, real time1, int level = 0);
+	int flatten(const bvh_node& node, real time0, real time1, int level = 0);
+	int flatten(const shared_ptr<hittable>& object, real time0, real time1, int level);
+	int add_node(const aabb& b);
+	int add_leaf(const shared_ptr<hittable>& object, real time0, real time1);
+	void link(int index, int second);
+};
+
+// Rounds the box outwards when narrowing to float so it stays conservative.
+int linear_bvh::add_node(const aabb& b)
+{
+	linear_bvh_node node{};
+	for (int a = 0; a < 3; a++)
+	{
+		node.bounds_min[a] = std::nextafter(static_cast<float>(b.min()[a]), -HUGE_VALF);
+		node.bounds_max[a] = std::nextafter(static_cast<float>(b.max()[a]), HUGE_VALF);
+	}
+	nodes.push_back(node);
+	return static_cast<int>(nodes.size() - 1);
+}
+
+linear_bvh::linear_bvh(const hittable_list& list, real time0, real time1)
+	: primitives(list.objects)
+{
+	list.bounding_box(time0, time1, box);
+	if (!primitives.empty())
+		build(0, primitives.size(), time0, time1);
+	for (const auto& primitive : primitives)
+		packets = packets && primitive->traces_packets();
+}
+
+linear_bvh::linear_bvh(const bvh_node& root, real time0, real time1)
+{
+	root.bounding_box(time0, time1, box);
+	flatten(root, time0, time1);
+	for (const auto& primitive : primitives)
+		packets = packets && primitive->traces_packets();
+}
+
+int linear_bvh::add_leaf(const shared_ptr<hittable>& object, real time0, real time1)
+{
+	aabb b;
+	object->bounding_box(time0, time1, b);
+	int index = add_node(b);
+	nodes[index].offset = static_cast<int32_t>(primitives.size());
+	nodes[index].count = 1;
+	primitives.push_back(object);
+	return index;
+}
+
+// Points an interior node at its second child and records the axis along
+// which its children are separated the most.
+void linear_bvh::link(int index, int second)
+{
+	const auto& l = nodes[index + 1];
+	const auto& r = nodes[second];
+	int axis = 0;
+	float best = -1;
+	for (int a = 0; a < 3; a++)
+	{
+		auto d = fabs((r.bounds_min[a] + r.bounds_max[a]) - (l.bounds_min[a] + l.bounds_max[a]));
+		if (d > best)
+		{
+			best = d;
+			axis = a;
+		}
+	}
+	nodes[index].offset = second;
+	nodes[index].axis = static_cast<uint8_t>(axis);
+	nodes[index].flip = (r.bounds_min[axis] + r.bounds_max[axis]) < (l.bounds_min[axis] + l.bounds_max[axis]);
+}
+
+int linear_bvh::build(size_t start, size_t end, real time0, real time1, int level)
+{
+	aabb b, temp_box;
+	primitives[start]->bounding_box(time0, time1, b);
+	for (size_t i = start + 1; i < end; i++)
+	{
+		primitives[i]->bounding_box(time0, time1, temp_box);
+		b = surrounding_box(b, temp_box);
+	}
+
+	int index = add_node(b);
+	if (end - start <= max_leaf_size)
+	{
+		nodes[index].offset = static_cast<int32_t>(start);
+		nodes[index].count = static_cast<uint16_t>(end - start);
+		depth = std::max(depth, level);
+		return index;
+	}
+
+	auto mid = bvh_node::sah_partition(primitives, start, end, time0, time1);
+	build(start, mid, time0, time1, level + 1);
+	link(index, build(mid, end, time0, time1, level + 1));
+	return index;
+}
+
+int linear_bvh::flatten(const bvh_node& node, real time0, real time1, int level)
+{
+	// A bvh_node over a single object stores it twice; keep one copy.
+	if (node.left == node.right)
+	{
+		depth = std::max(depth, level);
+		return add_leaf(node.left, time0, time1);
+	}
+
+	int index = add_node(node.box);
+	flatten(node.left, time0, time1, level + 1);
+	link(index, flatten(node.right, time0, time1, level + 1));
+	return index;
+}
+
+int linear_bvh::flatten(const shared_ptr<hittable>& object, real time0, real time1, int level)
+{
+	if (auto node = dynamic_cast<const bvh_node*>(object.get()))
+		return flatten(*node, time0, time1, level);
+	depth = std::max(depth, level);
+	return add_leaf(object, time0, time1);
+}
+
+bool linear_bvh::bounding_box(real t0, real t1, aabb& output_box) const
+{
+	output_box = box;
+	return !nodes.empty();
+}
+
+template <class F>
+void linear_bvh::traverse(const ray& r, real t_min, const real& t_max, F leaf) const
+{
+	if (nodes.empty())
+		return;
+
+	const auto& origin = r.orig;
+	const auto& inv_dir = r.inv_dir;
+	const int* dir_negative = r.sign;
+
+	auto box_hit = [&](const linear_bvh_node& node, real tmax) {
+		const float* bounds[2] = { node.bounds_min, node.bounds_max };
+		real tmin = t_min;
+		for (int a = 0; a < 3; a++)
+		{
+			auto t0 = (bounds[dir_negative[a]][a] - origin[a]) * inv_dir[a];
+			auto t1 = (bounds[1 - dir_negative[a]][a] - origin[a]) * inv_dir[a];
+			tmin = t0 > tmin ? t0 : tmin;
+			tmax = t1 < tmax ? t1 : tmax;
+		}
+		return tmin <= tmax;
+	};
+
+	int local[stack_size];
+	std::vector<int> deep;
+	int* stack = local;
+	if (depth > stack_size)
+	{
+		deep.resize(depth);
+		stack = deep.data();
+	}
+	int top = 0;
+	int current = 0;
+	while (true)
+	{
+		const auto& node = nodes[current];
+		if (box_hit(node, t_max))
+		{
+			if (node.is_leaf())
+			{
+				if (leaf(node.offset, node.offset + node.count))
+					return;
+			}
+			else if (dir_negative[node.axis] != (node.flip != 0))
+			{
+				stack[top++] = current + 1;
+				current = node.offset;
+				continue;
+			}
+			else
+			{
+				stack[top++] = node.offset;
+				current = current + 1;
+				continue;
+			}
+		}
+		if (top == 0)
+			break;
+		current = stack[--top];
+	}
+}
+
+bool linear_bvh::hit_deferred(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	bool hit_anything = false;
+	auto closest_so_far = t_max;
+	traverse(r, t_min, closest_so_far, [&](int first, int last) {
+		for (int i = first; i < last; i++)
+		{
+			if (primitives[i]->hit_deferred(r, t_min, closest_so_far, rec))
+			{
+				hit_anything = true;
+				closest_so_far = rec.t;
+			}
+		}
+		return false;
+	});
+	return hit_anything;
+}
+
+bool linear_bvh::occluded(const ray& r, real t_min, real t_max) const
+{
+	bool blocked = false;
+	traverse(r, t_min, t_max, [&](int first, int last) {
+		for (int i = first; i < last && !blocked; i++)
+			blocked = primitives[i]->occluded(r, t_min, t_max);
+		return blocked;
+	});
+	return blocked;
+}
+
+template <class F>
+void linear_bvh::traverse_packet(const ray_packet& p, int mask, const int neg[3], F leaf) const
+{
+	struct entry
+	{
+		int node;
+		int lanes;
+	};
+	entry local[stack_size];
+	std::vector<entry> deep;
+	entry* stack = local;
+	if (depth > stack_size)
+	{
+		deep.resize(depth);
+		stack = deep.data();
+	}
+	int top = 0;
+	entry current = { 0, mask };
+	while (true)
+	{
+		const auto& node = nodes[current.node];
+		int lanes = p.may_hit(node.bounds_min, node.bounds_max, current.lanes)
+			? p.box_mask(node.bounds_min, node.bounds_max, neg, current.lanes) : 0;
+		if (lanes)
+		{
+			if (node.is_leaf())
+				leaf(node.offset, node.offset + node.count, lanes);
+			else if (neg[node.axis] != (node.flip != 0))
+			{
+				stack[top++] = { current.node + 1, lanes };
+				current = { node.offset, lanes };
+				continue;
+			}
+			else
+			{
+				stack[top++] = { node.offset, lanes };
+				current = { current.node + 1, lanes };
+				continue;
+			}
+		}
+		if (top == 0)
+			break;
+		current = stack[--top];
+	}
+}
+
+// Every lane meets the nodes and primitives that traverse() would show it
+// alone, in the same order, so it ends on the same hit. Lanes that disagree
+// on a direction sign would order the children differently; they are split
+// into groups that agree, each walked on its own.
+int linear_bvh::hit_packet(ray_packet& p, int mask, packet_hits& hits) const
+{
+	if (nodes.empty())
+		return 0;
+	int lowered = 0;
+	auto leaf = [&](int first, int last, int lanes) {
+		for (int i = first; i < last; i++)
+			lowered |= primitives[i]->hit_packet(p, lanes, hits);
+	};
+	if (p.coherent)
+	{
+		traverse_packet(p, mask, p.sign, leaf);
+		return lowered;
+	}
+	while (mask)
+	{
+		int first = 0;
+		while (!((mask >> first) & 1))
+			first++;
+		int neg[3], group = 0;
+		for (int a = 0; a < 3; a++)
+			neg[a] = p.inv[a][first] < 0;
+		for (int i = first; i < p.size; i++)
+		{
+			bool same = (p.inv[0][i] < 0) == (neg[0] != 0) && (p.inv[1][i] < 0) == (neg[1] != 0)
+				&& (p.inv[2][i] < 0) == (neg[2] != 0);
+			group |= int(same && ((mask >> i) & 1)) << i;
+		}
+		traverse_packet(p, group, neg, leaf);
+		mask &= ~group;
+	}
+	return lowered;
+}
@@ -1,112 +1,161 @@
 #pragma once
+#include "hittable.h"
 #include "texture.h"
 
+// The closed set of materials, so code that must tell them apart (lights
+// are found by their diffuse_light) can do so without dynamic_cast.
+// Materials from outside this file report other.
+enum class material_type : unsigned char
+{
+	lambertian,
+	metal,
+	dielectric,
+	diffuse_light,
+	isotropic,
+	other
+};
+
+const int material_type_count = 6;
+
 class material
 {
 public:
+	explicit material(material_type type = material_type::other) : type(type) {}
+
+	const material_type type;
+
 	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
-	virtual color emitted(double u, double v, const point3& p) const
+	virtual color emitted(real u, real v, const point3& p) const
 	{
 		return color(0, 0, 0);
 	}
+	// Density over directions with which scatter() picks direction, for the
+	// diffuse materials that sample lights directly; 0 for the others.
+	virtual real scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const
+	{
+		return 0;
+	}
 };
 
-class lambertian : public material
+class lambertian final : public material
 {
 public:
 	shared_ptr<texture> albedo;
-	lambertian(shared_ptr<texture> a) : albedo(a){}
+	lambertian(shared_ptr<texture> a) : material(material_type::lambertian), albedo(a){}
 	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const
 	{
 		vec3 scatter_direction = rec.normal + random_unit_vector();
 		scattered = ray(rec.p, scatter_direction, r_in.time());
-		attenuation = albedo->value(rec.u, rec.v, rec.p);
+		auto width = r_in.width_at(rec.t);
+		scattered.continue_cone(r_in, width);
+		attenuation = albedo->filtered_value(rec.u, rec.v, rec.p, width * rec.uv_scale);
 		return true;
 	}
+	// normal + random_unit_vector() is cosine distributed about the normal.
+	virtual real scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const
+	{
+		auto cosine = dot(rec.normal, unit_vector(direction));
+		return cosine < 0 ? 0 : cosine / pi;
+	}
 };
 
-class metal : public material
+template <> struct arena_allocatable<lambertian> : std::true_type {};
+
+class metal final : public material
 {
 public:
 	color albedo; 
-	double fuzz;
-	metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+	real fuzz;
+	metal(const color& a, real f) : material(material_type::metal), albedo(a), fuzz(f < 1 ? f : 1) {}
 	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const
 	{
 		vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
 		scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere());
+		scattered.continue_cone(r_in, r_in.width_at(rec.t));
 		attenuation = albedo;
 		return (dot(scattered.direction(), rec.normal) > 0);
 	}
 };
 
-double schlick(double cosin, double ref_idx)
+real schlick(real cosin, real ref_idx)
 {
 	auto r0 = (1 - ref_idx) / (1 + ref_idx);
 	r0 = r0 * r0;
 	return r0 + (1 - r0) * pow((1 - cosin), 5);
 }
 
-class dielectric : public material
+class dielectric final : public material
 {
 public:
-	double ref_idx;
-	dielectric(double ri) : ref_idx(ri) {}
+	real ref_idx;
+	dielectric(real ri) : material(material_type::dielectric), ref_idx(ri) {}
 	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const
 	{
 		attenuation = color(1.0, 1.0, 1.0);
-		double etai_over_etat;
+		real etai_over_etat;
 		if (rec.front_face)
 			etai_over_etat = 1.0 / ref_idx;
 		else
 			etai_over_etat = ref_idx;
 
 		vec3 unit_direction = unit_vector(r_in.direction());
-		double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-		double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+		real cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+		real sin_theta = sqrt(1.0 - cos_theta * cos_theta);
 		if (etai_over_etat * sin_theta > 1.0)
 		{
 			vec3 reflected = reflect(unit_direction, rec.normal);
 			scattered = ray(rec.p, reflected);
+			scattered.continue_cone(r_in, r_in.width_at(rec.t));
 			return true;
 		}
-		double reflect_prob = schlick(cos_theta, etai_over_etat);
+		real reflect_prob = schlick(cos_theta, etai_over_etat);
 		if (random_double() < reflect_prob)
 		{
 			vec3 reflected = reflect(unit_direction, rec.normal);
 			scattered = ray(rec.p, reflected);
+			scattered.continue_cone(r_in, r_in.width_at(rec.t));
 			return true;
 		}
 		vec3 refracted = refract(unit_direction, rec.normal, etai_over_etat);
 		scattered = ray(rec.p, refracted);
+		scattered.continue_cone(r_in, r_in.width_at(rec.t));
 		return true;
 	}
 };
 
-class diffuse_light : public material
+class diffuse_light final : public material
 {
 public:
-	diffuse_light(shared_ptr<texture> a) : emit(a) {}
+	diffuse_light(shared_ptr<texture> a) : material(material_type::diffuse_light), emit(a) {}
 
 	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const { return false; }
 
-	virtual color emitted(double u, double v, const point3& p) const
+	virtual color emitted(real u, real v, const point3& p) const
 	{
 		return emit->value(u, v, p);
 	}
 	shared_ptr<texture> emit;
 };
 
-class isotropic : public material
+template <> struct arena_allocatable<diffuse_light> : std::true_type {};
+
+class isotropic final : public material
 {
 public:
-	isotropic(shared_ptr<texture> a) : albedo(a) {}
+	isotropic(shared_ptr<texture> a) : material(material_type::isotropic), albedo(a) {}
 	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
 		scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
+		scattered.continue_cone(r_in, r_in.width_at(rec.t));
 		attenuation = albedo->value(rec.u, rec.v, rec.p);
 		return true;
 	}
+	virtual real scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const
+	{
+		return 1 / (4 * pi);
+	}
 
 public:
 	shared_ptr<texture> albedo;
-};
\ No newline at end of file
+};
+
+template <> struct arena_allocatable<isotropic> : std::true_type {};
@@ -11,26 +11,33 @@
 #include "material.h"
 #include "aarec.h"
 #include "box.h"
-#include "bvh.h"
+#include "accel.h"
 #include "constant_medium.h"
+#include "scheduler.h"
+#include "integrator.h"
+#include "adaptive.h"
+#include "wavefront.h"
+#include "progressive.h"
+#include "framebuffer.h"
+#include "image_stream.h"
+#include "bench.h"
+#include <cstring>
 
-void avg_color(color& pixel_color, int samples_per_pixel)
-{
-	auto scale = 1.0 / samples_per_pixel;
-	pixel_color[0] = sqrt(pixel_color[0] * scale);
-	pixel_color[1] = sqrt(pixel_color[1] * scale);
-	pixel_color[2] = sqrt(pixel_color[2] * scale);
-
-	pixel_color[0] = static_cast<int>(256 * clamp(pixel_color[0], 0.0, 0.999));
-	pixel_color[1] = static_cast<int>(256 * clamp(pixel_color[1], 0.0, 0.999));
-	pixel_color[2] = static_cast<int>(256 * clamp(pixel_color[2], 0.0, 0.999));
-}
+// Image size and sample count can be lowered at build time for quick
+// renders, as compare_precision.sh does.
+#ifndef RT_IMAGE_WIDTH
+#define RT_IMAGE_WIDTH 600
+#endif
+#ifndef RT_SAMPLES_PER_PIXEL
+#define RT_SAMPLES_PER_PIXEL 200
+#endif
 
 color ray_color(const ray& r, const color& background, const hittable& world, int depth)
 {
 	hit_record rec;
 	if (depth <= 0)
 		return color(0, 0, 0);
+	path_stats::local().segments++;
 	if (!world.hit(r, 0.001, infinity, rec))
 		return background;
 
@@ -49,10 +56,20 @@ color ray_color(const ray& r, const color& background, const hittable& world, in
 	return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
 }
 
-hittable_list final_scene()
+// SAH cost of the two box trees of final_scene.
+struct scene_sah_cost
+{
+	double boxes1 = 0;
+	double boxes2 = 0;
+};
+
+// Objects are allocated from arena when one is given; it must outlive the scene.
+// The SAH cost of the box trees goes to sah_cost when one is given.
+hittable_list final_scene(accel_type accel = accel_type::linear_bvh, bvh_strategy strategy = bvh_strategy::sah,
+	scene_arena* arena = nullptr, scene_sah_cost* sah_cost = nullptr)
 {
 	hittable_list boxes1;
-	auto ground = make_shared<lambertian>(make_shared<solid_color>(0.48, 0.83, 0.53));
+	auto ground = make_shared_in<lambertian>(arena, make_shared_in<solid_color>(arena, 0.48, 0.83, 0.53));
 
 	const int boxes_per_side = 20;
 	for (int i = 0; i < boxes_per_side; i++) {
@@ -65,58 +82,112 @@ hittable_list final_scene()
 			auto z1 = z0 + w;
 			auto y1 = random_double(1, 101);
 
-			boxes1.add(make_shared<box>(point3(x0, y0, z0), point3(x1, y1, z1), ground));
+			boxes1.add(make_shared_in<box>(arena, point3(x0, y0, z0), point3(x1, y1, z1), ground));
 		}
 	}
 
 	hittable_list objects;
 
-	objects.add(make_shared<bvh_node>(boxes1, 0, 1));
-
-	auto light = make_shared<diffuse_light>(make_shared<solid_color>(7, 7, 7));
-	objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
+	auto light = make_shared_in<diffuse_light>(arena, make_shared_in<solid_color>(arena, 7, 7, 7));
+	objects.add(make_shared_in<xz_rect>(arena, 123, 423, 147, 412, 554, light));
 
 	auto center1 = point3(400, 400, 200);
 	auto center2 = center1 + vec3(30, 0, 0);
-	auto moving_sphere_material = make_shared<lambertian>(make_shared<solid_color>(0.7, 0.3, 0.1));
-	objects.add(make_shared<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
+	auto moving_sphere_material = make_shared_in<lambertian>(arena, make_shared_in<solid_color>(arena, 0.7, 0.3, 0.1));
+	objects.add(make_shared_in<moving_sphere>(arena, center1, center2, 0, 1, 50, moving_sphere_material));
 
-	objects.add(make_shared<sphere>(point3(260, 150, 45), 50, make_shared<dielectric>(1.5)));
-	objects.add(make_shared<sphere>(point3(0, 150, 145), 50, make_shared<metal>(color(0.8, 0.8, 0.9), 10.0)));
+	objects.add(make_shared_in<sphere>(arena, point3(260, 150, 45), 50, make_shared_in<dielectric>(arena, 1.5)));
+	objects.add(make_shared_in<sphere>(arena, point3(0, 150, 145), 50, make_shared_in<metal>(arena, color(0.8, 0.8, 0.9), 10.0)));
 
-	auto boundary = make_shared<sphere>(point3(360, 150, 145), 70, make_shared<dielectric>(1.5));
+	auto boundary = make_shared_in<sphere>(arena, point3(360, 150, 145), 70, make_shared_in<dielectric>(arena, 1.5));
 	objects.add(boundary);
-	objects.add(make_shared<constant_medium>(boundary, 0.2, make_shared<solid_color>(0.2, 0.4, 0.9)));
-	boundary = make_shared<sphere>(point3(0, 0, 0), 5000, make_shared<dielectric>(1.5));
-	objects.add(make_shared<constant_medium>(boundary, 0.0001, make_shared<solid_color>(1, 1, 1)));
+	objects.add(make_shared_in<constant_medium>(arena, boundary, 0.2, make_shared_in<solid_color>(arena, 0.2, 0.4, 0.9)));
+	boundary = make_shared_in<sphere>(arena, point3(0, 0, 0), 5000, make_shared_in<dielectric>(arena, 1.5));
+	objects.add(make_shared_in<constant_medium>(arena, boundary, 0.0001, make_shared_in<solid_color>(arena, 1, 1, 1)));
 
-	auto emat = make_shared<lambertian>(make_shared<image_texture>("earthmap.jpg"));
-	objects.add(make_shared<sphere>(point3(400, 200, 400), 100, emat));
-	auto pertext = make_shared<noise_texture>(0.1);
-	objects.add(make_shared<sphere>(point3(220, 280, 300), 80, make_shared<lambertian>(pertext)));
+	auto emat = make_shared_in<lambertian>(arena, make_shared_in<image_texture>(arena, "earthmap.jpg"));
+	objects.add(make_shared_in<sphere>(arena, point3(400, 200, 400), 100, emat));
+	auto pertext = make_shared_in<noise_texture>(arena, 0.1);
+	objects.add(make_shared_in<sphere>(arena, point3(220, 280, 300), 80, make_shared_in<lambertian>(arena, pertext)));
 
 	hittable_list boxes2;
-	auto white = make_shared<lambertian>(make_shared<solid_color>(0.73, 0.73, 0.73));
+	auto white = make_shared_in<lambertian>(arena, make_shared_in<solid_color>(arena, 0.73, 0.73, 0.73));
 	int ns = 1000;
 	for (int j = 0; j < ns; j++) {
-		boxes2.add(make_shared<sphere>(point3::random(0, 165), 10, white));
+		boxes2.add(make_shared_in<sphere>(arena, point3::random(0, 165), 10, white));
 	}
-	objects.add(make_shared<translate>(make_shared<rotate_y>(make_shared<bvh_node>(boxes2, 0.0, 1.0), 15), vec3(-100, 270, 395)));
-		
+
+	// Build the trees last: the random_axis strategy draws from the same
+	// stream as the scene, and this keeps the scene identical across strategies.
+	auto bvh1 = make_shared_in<bvh_node>(arena, boxes1, 0, 1, strategy, arena);
+	auto bvh2 = make_shared_in<bvh_node>(arena, boxes2, 0.0, 1.0, strategy, arena);
+	if (sah_cost)
+	{
+		sah_cost->boxes1 = bvh1->sah_cost(0, 1);
+		sah_cost->boxes2 = bvh2->sah_cost(0, 1);
+	}
+
+	objects.add(make_accel(bvh1, 0, 1, accel, arena));
+	objects.add(make_shared_in<translate>(arena, make_shared_in<rotate_y>(arena, make_accel(bvh2, 0, 1, accel, arena), 15), vec3(-100, 270, 395)));
+
 	return objects;
 
 }
 
-int main()
+hittable_list cornell_box(scene_arena* arena = nullptr)
+{
+	hittable_list objects;
+
+	auto red = make_shared_in<lambertian>(arena, make_shared_in<solid_color>(arena, 0.65, 0.05, 0.05));
+	auto white = make_shared_in<lambertian>(arena, make_shared_in<solid_color>(arena, 0.73, 0.73, 0.73));
+	auto green = make_shared_in<lambertian>(arena, make_shared_in<solid_color>(arena, 0.12, 0.45, 0.15));
+	auto light = make_shared_in<diffuse_light>(arena, make_shared_in<solid_color>(arena, 15, 15, 15));
+
+	objects.add(make_shared_in<yz_rect>(arena, 0, 555, 0, 555, 555, green));
+	objects.add(make_shared_in<yz_rect>(arena, 0, 555, 0, 555, 0, red));
+	objects.add(make_shared_in<xz_rect>(arena, 213, 343, 227, 332, 554, light));
+	objects.add(make_shared_in<xz_rect>(arena, 0, 555, 0, 555, 0, white));
+	objects.add(make_shared_in<xz_rect>(arena, 0, 555, 0, 555, 555, white));
+	objects.add(make_shared_in<xy_rect>(arena, 0, 555, 0, 555, 555, white));
+
+	shared_ptr<hittable> box1 = make_shared_in<box>(arena, point3(0, 0, 0), point3(165, 330, 165), white);
+	box1 = make_shared_in<rotate_y>(arena, box1, 15);
+	box1 = make_shared_in<translate>(arena, box1, vec3(265, 0, 295));
+	objects.add(box1);
+
+	shared_ptr<hittable> box2 = make_shared_in<box>(arena, point3(0, 0, 0), point3(165, 165, 165), white);
+	box2 = make_shared_in<rotate_y>(arena, box2, -18);
+	box2 = make_shared_in<translate>(arena, box2, vec3(130, 0, 65));
+	objects.add(box2);
+
+	return objects;
+}
+
+int main(int argc, char* argv[])
 {
 	const auto aspect_ratio = 1.0 / 1.0;
-	const int image_width = 600;
+	const int image_width = RT_IMAGE_WIDTH;
 	const int image_height = static_cast<int>(image_width / aspect_ratio);
-	const int samples_per_pixel = 1000;
+	const int samples_per_pixel = RT_SAMPLES_PER_PIXEL;	// light sampling matches the noise of 1000 without it
 	const int max_depth = 50;
-	int channel = 3;
+	const auto path_integrator = integrator_type::iterative;	// wavefront renders the same image no faster
+	const bool adaptive_sampling = true;
+	const bool packet_tracing = true;	// camera rays of a pixel traced as ray_packets by the iterative integrator, when every object has a packet form
+	const bool light_sampling = true;	// next-event estimation in the iterative and wavefront integrators
+	const bool texture_filtering = true;	// camera ray cones pick the MIP level of image textures
+	const size_t texture_budget = size_t(64) << 20;	// texels the texture cache keeps resident
+	const int pass_spp = 16;		// samples per pixel each progressive pass adds to the whole image
+	const auto display_curve = tonemap_operator::clamp;	// only the JPEG is tonemapped
+	const double exposure = 1;
+	adaptive_settings adaptive;
+	adaptive.max_spp = samples_per_pixel;
 
-	auto world = final_scene();
+	bool cornell = false, streaming = false;
+	for (int a = 1; a < argc; a++)
+	{
+		cornell |= strcmp(argv[a], "--cornell") == 0;
+		streaming |= strcmp(argv[a], "--stream") == 0;
+	}
 
 	point3 lookfrom(478, 278, -600);
 	point3 lookat(278, 278, 0);
@@ -126,27 +197,328 @@ int main()
 	auto vfov = 40.0;
 	color background(0, 0, 0);
 	camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
-	unsigned char* data = new unsigned char[image_width * image_height * channel];
-	for (int j = image_height - 1; j >= 0; --j)
+	camera cornell_cam(point3(278, 278, -800), lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
+
+	// Offline conversion to the mapped texture format; image_texture loads
+	// either kind of file.
+	if (argc > 1 && strcmp(argv[1], "--make-tex") == 0)
 	{
-		for (int i = 0; i < image_width; ++i)
+		if (argc != 4)
+		{
+			std::cerr << "usage: " << argv[0] << " --make-tex <image> <texture file>\n";
+			return 1;
+		}
+		if (!convert_texture(argv[2], argv[3]))
 		{
-			color pixel_color(0, 0, 0);
-			for (int s = 0; s < samples_per_pixel; ++s)
+			std::cerr << "could not convert " << argv[2] << " to " << argv[3] << '\n';
+			return 1;
+		}
+		return 0;
+	}
+
+	// Compares two renders of one scene, such as those of the double and
+	// float builds; fails when they differ by more than max_rmse as displayed.
+	if (argc > 1 && strcmp(argv[1], "--compare") == 0)
+	{
+		if (argc != 4 && argc != 5)
+		{
+			std::cerr << "usage: " << argv[0] << " --compare <a.pfm> <b.pfm> [max_rmse]\n";
+			return 1;
+		}
+		auto a = read_pfm(argv[2]), b = read_pfm(argv[3]);
+		if (a.width == 0 || b.width == 0 || a.width != b.width || a.height != b.height)
+		{
+			std::cerr << "could not read two images of one size from " << argv[2] << " and " << argv[3] << '\n';
+			return 1;
+		}
+		const double max_rmse = argc == 5 ? atof(argv[4]) : 0.02;
+		double mean_a = 0, mean_b = 0;
+		for (int p = 0; p < a.width * a.height; p++)
+		{
+			for (int k = 0; k < 3; k++)
 			{
-				
-				auto u = double(i + random_double()) / (image_width - 1);
-				auto v = double(j + random_double()) / (image_height - 1);
-				ray r = cam.get_ray(u, v);
-				pixel_color += ray_color(r, background, world, max_depth);
+				mean_a += a.get(p)[k];
+				mean_b += b.get(p)[k];
 			}
-			avg_color(pixel_color, samples_per_pixel);
-			data[(image_height - j - 1) * image_width * channel + i * channel] = pixel_color[0];
-			data[(image_height - j - 1) * image_width * channel + i * channel + 1] = pixel_color[1];
-			data[(image_height - j - 1) * image_width * channel + i * channel + 2] = pixel_color[2];
 		}
+		const double rmse = display_rmse(a, b);
+		std::cout << "mean " << mean_a / (3.0 * a.width * a.height) << " vs " << mean_b / (3.0 * b.width * b.height)
+				  << ", display RMSE " << rmse << " (max " << max_rmse << ")\n";
+		return rmse <= max_rmse ? 0 : 1;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+	{
+		// Both strategies build from the same seed, so they split one scene.
+		scene_sah_cost sah, random_axis;
+		seed_random(0);
+		final_scene(accel_type::bvh_node, bvh_strategy::sah, nullptr, &sah);
+		seed_random(0);
+		final_scene(accel_type::bvh_node, bvh_strategy::random_axis, nullptr, &random_axis);
+		std::cout << "SAH cost:       sah  random_axis\n" << std::fixed << std::setprecision(2)
+				  << "  boxes1  " << std::setw(8) << sah.boxes1 << std::setw(13) << random_axis.boxes1 << '\n'
+				  << "  boxes2  " << std::setw(8) << sah.boxes2 << std::setw(13) << random_axis.boxes2 << '\n'
+				  << std::defaultfloat;
+		bench_accel([](accel_type accel) { seed_random(0); return final_scene(accel); }, cam, 300, 300);
+		bench_hit_record(make_shared<lambertian>(make_shared<solid_color>(0.5, 0.5, 0.5)),
+			std::max(1u, std::thread::hardware_concurrency()));
+		bench_aabb();
+		bench_vec3();
+		bench_packets("cornell box", cornell_box(), cornell_cam, 300, 300);
+		seed_random(0);
+		bench_packets("final scene", final_scene(accel_type::linear_bvh), cam, 300, 300);
+		bench_occlusion(cornell_box(), cornell_cam, 300, 300);
+		seed_random(0);
+		bench_occlusion(final_scene(), cam, 300, 300);
+		bench_texture("earthmap.jpg", point3(400, 200, 400), 100, cam, 300, 300);
+		return 0;
+	}
+
+	texture_cache::global().set_budget(texture_budget);
+	scene_arena arena;
+	auto world = cornell ? cornell_box(&arena) : final_scene(accel_type::linear_bvh, bvh_strategy::sah, &arena);
+	if (cornell)
+		cam = cornell_cam;
+	if (texture_filtering)
+		cam.set_image_width(image_width);
+	std::cerr << "scene arena: " << arena.bytes_used() / 1024 << " KiB in " << arena.block_count() << " blocks\n";
+	light_list scene_lights(world);
+	const light_list* lights = light_sampling ? &scene_lights : nullptr;
+	std::cerr << "lights: " << scene_lights.lights.size() << (light_sampling ? " sampled\n" : " (not sampled)\n");
+	// Objects without a packet form trace a packet a lane at a time, which
+	// costs more than single rays (see --bench), so packets need them all.
+	const bool trace_packets = packet_tracing && path_integrator == integrator_type::iterative
+		&& world.traces_packets();
+	std::cerr << "camera ray packets: " << (trace_packets ? "on\n" : "off\n");
+
+	// The image is rendered in passes of pass_spp, each ending with a preview
+	// and a checkpoint; a killed job restarted with the same settings picks
+	// up after the last completed pass.
+	//
+	// Streaming (--stream) is for images too large to hold anything per
+	// pixel: each tile runs all its passes before the next, only the tiles in
+	// flight keep estimators, and the PFM is the only image written as it
+	// renders. There are no previews or checkpoints. At the end the HDR and
+	// EXR are converted from the PFM a row at a time, and the JPEG and spp
+	// heatmap are reduced to at most preview_size on a side. The passes and
+	// their samples are the same, so both modes render the same image.
+	const std::string output = cornell ? "cornell" : "nextwk";
+	const std::string checkpoint = cornell ? "cornell.ckpt" : "nextwk.ckpt";
+	const int passes = (adaptive.max_spp + pass_spp - 1) / pass_spp;
+	const tile frame{ 0, 0, image_width, image_height };
+	std::vector<pixel_estimator> pixels(streaming ? 0 : image_width * image_height);
+	const int preview_size = 1024;
+	long long samples = 0;
+	reduced_image spp_preview(streaming ? image_width : 1, streaming ? image_height : 1, preview_size);
+	std::mutex spp_mutex;
+	progressive_settings settings;
+	settings.scene = output;
+	settings.objects = int(world.objects.size());
+	settings.lights = int(scene_lights.lights.size());
+	settings.width = image_width;
+	settings.height = image_height;
+	settings.max_depth = max_depth;
+	settings.light_sampling = light_sampling;
+	settings.texture_filtering = texture_filtering;
+	settings.pass_spp = pass_spp;
+	settings.adaptive_sampling = adaptive_sampling;
+	settings.adaptive = adaptive;
+	int pass = 0;
+	if (!streaming && load_checkpoint(checkpoint, settings, pass, pixels))
+		std::cerr << "resuming from " << checkpoint << " after pass " << pass << " of " << passes << '\n';
+
+	// The PFM is written in place tile by tile as the passes run; see
+	// pfm_stream. Each pass preview writes the JPEG, and the HDR and EXR
+	// follow once the render is complete.
+	auto pixel_mean = [&](int p) { return pixels[p].total() / std::max(pixels[p].count(), 1); };
+	pfm_stream stream(output + ".pfm", image_width, image_height);
+	if (!stream.is_open())
+		std::cerr << "could not open " << output << ".pfm\n";
+	// Opening the PFM cleared it; a resumed render writes back what the
+	// checkpoint holds before any pass, even if none is left to run.
+	if (pass > 0)
+	{
+		stream.write_tile(frame, pixel_mean);
+		stream.flush();
+	}
+
+	auto write_image = [&](bool complete) {
+		framebuffer image(image_width, image_height);
+		for (int p = 0; p < image_width * image_height; p++)
+			image.set(p, pixel_mean(p));
+		auto ldr = tonemap(image, display_curve, exposure);
+		stbi_write_jpg((output + ".jpg").c_str(), image_width, image_height, 3, ldr.data(), 100);
+		if (!complete)
+			return;
+		if (!write_hdr((output + ".hdr").c_str(), image))
+			std::cerr << "could not write " << output << ".hdr\n";
+		if (!write_exr((output + ".exr").c_str(), image))
+			std::cerr << "could not write " << output << ".exr\n";
+	};
+
+	auto write_streamed_images = [&] {
+		auto row = [&](int y, float* rgb) { return stream.read_row(y, rgb); };
+		if (!write_hdr((output + ".hdr").c_str(), image_width, image_height, row))
+			std::cerr << "could not write " << output << ".hdr\n";
+		if (!write_exr((output + ".exr").c_str(), image_width, image_height, row))
+			std::cerr << "could not write " << output << ".exr\n";
+		reduced_image preview(image_width, image_height, preview_size);
+		std::vector<float> line(size_t(image_width) * 3);
+		for (int y = 0; y < image_height && row(y, line.data()); y++)
+		{
+			for (int x = 0; x < image_width; x++)
+				preview.add(x, y, color(line[x * 3], line[x * 3 + 1], line[x * 3 + 2]));
+		}
+		auto image = preview.image();
+		auto ldr = tonemap(image, display_curve, exposure);
+		stbi_write_jpg((output + ".jpg").c_str(), image.width, image.height, 3, ldr.data(), 100);
+	};
+
+	path_stats stats;
+	texture_stats texture_lookups;
+	tile_scheduler scheduler(image_width, image_height);
+	// One per worker, so its path buffers are allocated once and reused by
+	// every tile and pass.
+	std::vector<wavefront_renderer> wavefronts;
+	for (int k = 0; k < scheduler.threads(); k++)
+		wavefronts.emplace_back(world, background, max_depth, lights);
+
+	// Runs passes [first_pass, last_pass) over tile t; estimators cover area.
+	auto render_passes = [&](const tile& t, int worker, int first_pass, int last_pass,
+		std::vector<pixel_estimator>& estimators, const tile& area) {
+		auto camera_ray = [&](int i, int y, int s) {
+			int j = image_height - 1 - y;
+			seed_random(y * image_width + i, s);
+			auto u = double(i + random_double()) / (image_width - 1);
+			auto v = double(j + random_double()) / (image_height - 1);
+			return cam.get_ray(u, v);
+		};
+
+		auto trace_pixel = [&](int i, int y, int first, int last, pixel_estimator& pixel) {
+			if (!trace_packets)
+			{
+				for (int s = first; s < last; s++)
+				{
+					ray r = camera_ray(i, y, s);
+					pixel.add(path_integrator == integrator_type::iterative
+						? ray_color_iterative(r, background, world, max_depth, lights)
+						: ray_color(r, background, world, max_depth));
+				}
+				return;
+			}
+
+			// The samples of a pixel are as coherent as camera rays get. Each
+			// keeps its own random stream through the packet and resumes it
+			// for the rest of its path, which is traced one ray at a time,
+			// so the image matches tracing every sample alone.
+			for (int s0 = first; s0 < last; s0 += ray_packet::width)
+			{
+				ray_packet packet;
+				ray rays[ray_packet::width];
+				pcg32 streams[ray_packet::width];
+				int n = std::min(int(ray_packet::width), last - s0);
+				for (int k = 0; k < n; k++)
+				{
+					rays[k] = camera_ray(i, y, s0 + k);
+					streams[k] = random_generator();
+					packet.add(rays[k]);
+				}
+				packet.finish();
+
+				hit_record recs[ray_packet::width];
+				int hits = hit_packet(world, packet, streams, recs);
+				for (int k = 0; k < n; k++)
+				{
+					random_generator() = streams[k];
+					pixel.add(ray_color_iterative(rays[k], (hits >> k) & 1, recs[k], background, world, max_depth, lights));
+				}
+			}
+		};
+
+		auto sample = [&](const std::vector<sample_span>& spans) {
+			if (path_integrator == integrator_type::wavefront)
+			{
+				wavefronts[worker].render(spans, camera_ray);
+				return;
+			}
+			for (const auto& span : spans)
+				trace_pixel(span.x, span.y, span.first, span.last, *span.pixel);
+		};
+
+		for (int p = first_pass; p < last_pass; p++)
+			path_stats::local().paths += sample_tile(t, adaptive, adaptive_sampling, (p + 1) * pass_spp, sample, estimators, area);
+		stats.collect_local();
+		texture_lookups.collect_local();
+	};
+
+	if (streaming)
+	{
+		scheduler.run([&](const tile& t, int worker)
+		{
+			const int w = t.x1 - t.x0;
+			std::vector<pixel_estimator> estimators(w * (t.y1 - t.y0));
+			render_passes(t, worker, 0, passes, estimators, t);
+			stream.write_tile(t, [&](int p) {
+				const auto& e = estimators[(p / image_width - t.y0) * w + p % image_width - t.x0];
+				return e.total() / std::max(e.count(), 1);
+			});
+			std::lock_guard<std::mutex> lock(spp_mutex);
+			for (int k = 0; k < int(estimators.size()); k++)
+			{
+				samples += estimators[k].count();
+				spp_preview.add(t.x0 + k % w, t.y0 + k / w, color(estimators[k].count(), 0, 0));
+			}
+		});
+		stream.flush();
+		write_streamed_images();
+	}
+	for (; !streaming && pass < passes; pass++)
+	{
+		scheduler.run([&](const tile& t, int worker)
+		{
+			render_passes(t, worker, pass, pass + 1, pixels, frame);
+			stream.write_tile(t, pixel_mean);
+		});
+		stream.flush();
+		write_image(false);
+		if (!save_checkpoint(checkpoint, settings, pass + 1, pixels))
+			std::cerr << "could not write " << checkpoint << '\n';
+		std::cerr << "pass " << pass + 1 << " of " << passes << " done\n";
+	}
+	if (!streaming)
+	{
+		write_image(true);
+		std::remove(checkpoint.c_str());
+	}
+
+	// The heatmap is of the spp of every pixel, or of their means over the
+	// blocks of spp_preview.
+	int spp_width = image_width, spp_height = image_height;
+	std::vector<int> spp;
+	if (streaming)
+	{
+		auto reduced = spp_preview.image();
+		spp_width = reduced.width;
+		spp_height = reduced.height;
+		for (int p = 0; p < spp_width * spp_height; p++)
+			spp.push_back(static_cast<int>(lround(reduced.get(p).x())));
+	}
+	for (int p = 0; !streaming && p < image_width * image_height; p++)
+	{
+		spp.push_back(pixels[p].count());
+		samples += spp[p];
 	}
-	stbi_write_jpg("nextwk.jpg", image_width, image_height, channel, data, 100);
+	std::cout << "paths: " << stats.paths << ", average length: " << stats.average_length()
+			  << " segments, roulette terminated: " << stats.terminated
+			  << ", shadow rays: " << stats.shadow_rays << '\n';
+	std::cout << "average spp: " << double(samples) / (image_width * image_height) << '\n';
+	auto cache = texture_cache::global().stats();
+	std::cout << "texture cache: " << cache.images << " images (" << cache.mapped << " mapped) for " << cache.requests << " requests, "
+			  << texture_lookups.hits << " hits, " << texture_lookups.misses << " misses, "
+			  << cache.evictions << " evictions, peak " << cache.peak_bytes / 1024 << " of "
+			  << cache.budget / 1024 << " KiB\n";
+	if (adaptive_sampling)
+		write_spp_heatmap("spp_heatmap.jpg", spp, spp_width, spp_height, adaptive);
 	std::cout << "finish.\n";
 	//system("PAUSE");
 }
\ No newline at end of file
@@ -0,0 +1,177 @@
+#pragma once
+#include "rtweekend.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// An 8-bit RGB image and its MIP levels, each halving the last down to 1x1.
+// Every level is stored in 8x8 tiles, tiles in row order and the texels of a
+// tile in Morton order, four bytes per texel. A bilinear lookup then touches
+// one or two 256-byte tiles instead of two scanlines a whole image width
+// apart, and neighbouring lookups tend to land in the same tiles.
+class mip_pyramid
+{
+public:
+	static const int tile_size = 8;
+	static const int texel_bytes = 4;	// RGB and a pad byte
+	static const int tile_bytes = tile_size * tile_size * texel_bytes;
+
+	struct level
+	{
+		int width, height;
+		int tiles_x;
+		size_t offset;	// of the level's first tile, in bytes
+	};
+
+	mip_pyramid() {}
+
+	// A pyramid over texels kept elsewhere, such as a mapped texture file;
+	// data must hold the levels' bytes for as long as the pyramid is used.
+	mip_pyramid(std::vector<level> table, const unsigned char* data, size_t bytes)
+		: levels(std::move(table)), external(data), bytes(bytes) {}
+
+	// rgb is width x height packed 3-byte texels, rows from the top.
+	mip_pyramid(const unsigned char* rgb, int width, int height)
+	{
+		std::vector<unsigned char> image(rgb, rgb + size_t(width) * height * 3);
+		size_t offset = 0;
+		while (true)
+		{
+			level l{ width, height, (width + tile_size - 1) / tile_size, offset };
+			int tiles_y = (height + tile_size - 1) / tile_size;
+			levels.push_back(l);
+			offset += size_t(l.tiles_x) * tiles_y * tile_bytes;
+			texels.resize(offset);
+			bytes = offset;
+			for (int y = 0; y < height; y++)
+			{
+				for (int x = 0; x < width; x++)
+				{
+					unsigned char* t = &texels[index(l, x, y)];
+					memcpy(t, &image[(size_t(y) * width + x) * 3], 3);
+					t[3] = 255;
+				}
+			}
+			if (width == 1 && height == 1)
+				break;
+			image = downsample(image, width, height);
+			width = std::max(width / 2, 1);
+			height = std::max(height / 2, 1);
+		}
+	}
+
+	// One texel as stored: R, G, B and the pad byte.
+	struct texel_value
+	{
+		unsigned char c[texel_bytes];
+	};
+
+	bool empty() const { return levels.empty(); }
+	int level_count() const { return int(levels.size()); }
+	int width() const { return levels[0].width; }
+	int height() const { return levels[0].height; }
+
+	// Size of all levels together, and their bytes while this pyramid holds
+	// them; release_texels() keeps only the layout, for a caller that stores
+	// the texels elsewhere and samples through a fetch function.
+	size_t byte_size() const { return bytes; }
+	const unsigned char* data() const { return external ? external : texels.data(); }
+	const std::vector<level>& level_table() const { return levels; }
+	void release_texels() { std::vector<unsigned char>().swap(texels); }
+
+	// Average over a footprint width wide in (u, v), blending the two levels
+	// whose texels are nearest that size. Texels are taken as square, of
+	// side one over sqrt(width * height) in (u, v); widths below one texel
+	// give a bilinear lookup at level 0. v runs bottom to top.
+	color trilinear(real u, real v, real width) const
+	{
+		return trilinear(u, v, width, [this](size_t offset) {
+			texel_value t;
+			memcpy(&t, data() + offset, sizeof(t));
+			return t;
+		});
+	}
+
+	// As above, with fetch(offset) returning the texel_value at that byte
+	// offset of the levels.
+	template <class F>
+	color trilinear(real u, real v, real width, F fetch) const
+	{
+		u = clamp(u, 0.0, 1.0);
+		v = 1 - clamp(v, 0.0, 1.0);
+		if (!(width > 0))
+			return bilinear(levels[0], u, v, fetch);
+		real texels_wide = width * std::sqrt(real(levels[0].width) * levels[0].height);
+		if (!(texels_wide > 1))
+			return bilinear(levels[0], u, v, fetch);
+		real lod = std::min(real(std::log2(texels_wide)), real(level_count() - 1));
+		int l0 = static_cast<int>(lod);
+		real f = lod - l0;
+		if (l0 + 1 >= level_count() || f == 0)
+			return bilinear(levels[l0], u, v, fetch);
+		return (1 - f) * bilinear(levels[l0], u, v, fetch) + f * bilinear(levels[l0 + 1], u, v, fetch);
+	}
+
+private:
+	// Byte offset of texel (x, y) of l.
+	static size_t index(const level& l, int x, int y)
+	{
+		// Bits of 0..7 spread to every other bit position.
+		static const int spread[tile_size] = { 0, 1, 4, 5, 16, 17, 20, 21 };
+		size_t tile = size_t(y / tile_size) * l.tiles_x + x / tile_size;
+		int within = spread[x % tile_size] | (spread[y % tile_size] << 1);
+		return l.offset + tile * tile_bytes + within * texel_bytes;
+	}
+
+	// Clamped to the edges; (u, v) in image orientation.
+	template <class F>
+	color bilinear(const level& l, real u, real v, F fetch) const
+	{
+		real s = u * l.width - real(0.5), t = v * l.height - real(0.5);
+		// s, t >= -0.5, so truncating s + 1 floors without calling floor().
+		int x0 = static_cast<int>(s + 1) - 1, y0 = static_cast<int>(t + 1) - 1;
+		real fx = s - x0, fy = t - y0;
+		int x1 = std::min(x0 + 1, l.width - 1), y1 = std::min(y0 + 1, l.height - 1);
+		x0 = std::max(x0, 0);
+		y0 = std::max(y0, 0);
+		const texel_value t00 = fetch(index(l, x0, y0));
+		const texel_value t10 = fetch(index(l, x1, y0));
+		const texel_value t01 = fetch(index(l, x0, y1));
+		const texel_value t11 = fetch(index(l, x1, y1));
+		const real w00 = (1 - fx) * (1 - fy), w10 = fx * (1 - fy), w01 = (1 - fx) * fy, w11 = fx * fy;
+		const real color_scale = real(1.0 / 255.0);
+		real c[3];
+		for (int k = 0; k < 3; k++)
+			c[k] = color_scale * (w00 * t00.c[k] + w10 * t10.c[k] + w01 * t01.c[k] + w11 * t11.c[k]);
+		return color(c[0], c[1], c[2]);
+	}
+
+	// 2x2 box filter; an odd size drops its last row or column.
+	static std::vector<unsigned char> downsample(const std::vector<unsigned char>& image, int width, int height)
+	{
+		int w = std::max(width / 2, 1), h = std::max(height / 2, 1);
+		std::vector<unsigned char> half(size_t(w) * h * 3);
+		for (int y = 0; y < h; y++)
+		{
+			int ya = std::min(2 * y, height - 1), yb = std::min(2 * y + 1, height - 1);
+			for (int x = 0; x < w; x++)
+			{
+				int xa = std::min(2 * x, width - 1), xb = std::min(2 * x + 1, width - 1);
+				for (int c = 0; c < 3; c++)
+				{
+					int sum = image[(size_t(ya) * width + xa) * 3 + c] + image[(size_t(ya) * width + xb) * 3 + c]
+						+ image[(size_t(yb) * width + xa) * 3 + c] + image[(size_t(yb) * width + xb) * 3 + c];
+					half[(size_t(y) * w + x) * 3 + c] = static_cast<unsigned char>((sum + 2) / 4);
+				}
+			}
+		}
+		return half;
+	}
+
+	std::vector<level> levels;
+	std::vector<unsigned char> texels;
+	const unsigned char* external = nullptr;
+	size_t bytes = 0;
+};
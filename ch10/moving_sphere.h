@@ -1,65 +1,77 @@
 #pragma once
 #include "hittable.h"
+#include "sphere.h"
 #include "vec3.h"
 
 class moving_sphere : public hittable
 {
 public:
 	moving_sphere() {}
-	moving_sphere(point3 cen0, point3 cen1, double t0, double t1, double r, shared_ptr<material> m) : center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat_ptr(m) {}
+	moving_sphere(point3 cen0, point3 cen1, real t0, real t1, real r, shared_ptr<material> m) : center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat_ptr(m) {}
 
-	virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
-	virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+	virtual bool hit(const ray& r, real tmin, real tmax, hit_record& rec) const;
+	virtual bool hit_deferred(const ray& r, real tmin, real tmax, hit_record& rec) const;
+	virtual void complete(const ray& r, hit_record& rec) const;
+	virtual bool occluded(const ray& r, real t_min, real t_max) const;
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const;
 	
-	point3 center(double time) const;
+	point3 center(real time) const;
 
 public:
 	point3 center0, center1;
-	double time0, time1;
-	double radius;
+	real time0, time1;
+	real radius;
 	shared_ptr<material> mat_ptr;
 };
 
-point3 moving_sphere::center(double time) const
+template <> struct arena_allocatable<moving_sphere> : std::true_type {};
+
+point3 moving_sphere::center(real time) const
 {
 	return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
 }
 
-bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool moving_sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	if (!hit_deferred(r, t_min, t_max, rec))
+		return false;
+	complete(r, rec);
+	rec.object = nullptr;
+	return true;
+}
+
+// As sphere::hit_deferred, with the centre at the ray's time.
+bool moving_sphere::hit_deferred(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	real near_t, far_t;
+	if (!sphere_roots(r.origin() - center(r.time()), r.direction(), radius, near_t, far_t))
+		return false;
+	auto t = near_t < t_max && near_t > t_min ? near_t : far_t;
+	if (!(t < t_max && t > t_min))
+		return false;
+	rec.t = t;
+	rec.object = this;
+	return true;
+}
+
+void moving_sphere::complete(const ray& r, hit_record& rec) const
 {
-	vec3 oc = r.origin() - center(r.time());
-	auto a = dot(r.direction(), r.direction());
-	auto half_b = dot(oc, r.direction());
-	auto c = oc.length_squared() - radius * radius;
-	auto discriminator = half_b * half_b - a * c;
+	rec.p = r.at(rec.t);
+	auto outward_normal = (rec.p - center(r.time())) / radius;
+	rec.set_face_normal(r, outward_normal);
+	rec.uv_scale = 0;	// no (u, v) either
+	rec.mat_ptr = mat_ptr.get();
+}
 
-	if (discriminator > 0)
-	{
-		auto root = sqrt(discriminator);
-		auto temp = (-half_b - root) / a;
-		if (temp<t_max && temp>t_min)
-		{
-			rec.t = temp;
-			rec.p = r.at(temp);
-			auto outward_normal = (rec.p - center(r.time())) / radius;
-			rec.set_face_normal(r, outward_normal);
-			rec.mat_ptr = mat_ptr;
-			return true;
-		}
-		temp = (-half_b + root) / a;
-		if (temp<t_max && temp>t_min)
-		{
-			rec.t = temp;
-			rec.p = r.at(temp);
-			auto outward_normal = (rec.p - center(r.time())) / radius;
-			rec.set_face_normal(r, outward_normal);
-			rec.mat_ptr = mat_ptr;
-			return true;
-		}
-	}
-	return false;
+bool moving_sphere::occluded(const ray& r, real t_min, real t_max) const
+{
+	real near_t, far_t;
+	if (!sphere_roots(r.origin() - center(r.time()), r.direction(), radius, near_t, far_t))
+		return false;
+	return (near_t < t_max && near_t > t_min) || (far_t < t_max && far_t > t_min);
 }
-bool moving_sphere::bounding_box(double t0, double t1, aabb& output_box) const
+
+bool moving_sphere::bounding_box(real t0, real t1, aabb& output_box) const
 {
 	aabb box0(center(t0) - vec3(radius, radius, radius),
 			  center(t0) + vec3(radius, radius, radius));
@@ -4,7 +4,7 @@ class perlin
 {
 public:
 	perlin() {
-		//ranfloat = new double[point_count];
+		//ranfloat = new real[point_count];
 		ranvec = new vec3[point_count];
 
 		for (int i = 0; i < point_count; ++i) {
@@ -23,7 +23,7 @@ public:
 		delete[] perm_z;
 	}
 
-	double noise(const point3& p) const {
+	real noise(const point3& p) const {
 		auto u = p.x() - floor(p.x());
 		auto v = p.y() - floor(p.y());
 		auto w = p.z() - floor(p.z());
@@ -43,7 +43,7 @@ public:
 		return perlin_interp(c, u, v, w);
 	}
 
-	double turb(const point3& p, int depth = 7) const
+	real turb(const point3& p, int depth = 7) const
 	{
 		auto accum = 0.0;
 		auto temp_p = p;
@@ -87,7 +87,7 @@ private:
 		}
 	}
 
-	inline static double perlin_interp(vec3 c[2][2][2], double u, double v, double w) {
+	inline static real perlin_interp(vec3 c[2][2][2], real u, real v, real w) {
 		auto uu = u * u * (3 - 2 * u);
 		auto vv = v * v * (3 - 2 * v);
 		auto ww = w * w * (3 - 2 * w);
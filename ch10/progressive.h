@@ -0,0 +1,126 @@
+#pragma once
+#include "adaptive.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// What a checkpoint has to match to be resumed: the scene, the image, and
+// every setting that changes which samples are taken or what they return.
+// The scene is known by its name and the counts of its top-level objects
+// and sampled lights.
+struct progressive_settings
+{
+	std::string scene;
+	int objects = 0, lights = 0;
+	int width = 0, height = 0;
+	int max_depth = 50;
+	bool light_sampling = true;
+	bool texture_filtering = true;
+	int pass_spp = 16;
+	bool adaptive_sampling = true;
+	adaptive_settings adaptive;
+};
+
+// Binary checkpoint of a progressive render: this header, then the state of
+// every pixel_estimator, row-major. The estimators are restored exactly, so
+// a resumed render ends with the same image as one that was never stopped.
+struct checkpoint_header
+{
+	char magic[4] = { 'R', 'T', 'C', 'K' };
+	uint32_t version = 3;
+	char scene[16] = {};				// name, zero padded and cut to fit
+	uint32_t objects = 0;
+	uint32_t lights = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t real_size = sizeof(real);	// a float build cannot read a double checkpoint
+	uint32_t passes = 0;				// passes completed
+	uint32_t max_depth = 0;
+	uint32_t light_sampling = 0;
+	uint32_t texture_filtering = 0;
+	uint32_t pass_spp = 0;
+	uint32_t adaptive_sampling = 0;
+	uint32_t min_spp = 0;
+	uint32_t max_spp = 0;
+	uint32_t batch = 0;
+	double max_error = 0;
+	double luminance_floor = 0;
+
+	checkpoint_header() {}
+
+	checkpoint_header(const progressive_settings& s)
+		: objects(s.objects), lights(s.lights), width(s.width), height(s.height), max_depth(s.max_depth),
+		  light_sampling(s.light_sampling), texture_filtering(s.texture_filtering), pass_spp(s.pass_spp),
+		  adaptive_sampling(s.adaptive_sampling), min_spp(s.adaptive.min_spp), max_spp(s.adaptive.max_spp),
+		  batch(s.adaptive.batch), max_error(s.adaptive.max_error), luminance_floor(s.adaptive.luminance_floor)
+	{
+		memcpy(scene, s.scene.data(), std::min(s.scene.size(), sizeof(scene)));
+	}
+
+	// Same format, scene and render settings; the pass count may differ.
+	bool matches(const checkpoint_header& h) const
+	{
+		return memcmp(magic, h.magic, sizeof(magic)) == 0 && version == h.version
+			&& memcmp(scene, h.scene, sizeof(scene)) == 0 && objects == h.objects && lights == h.lights
+			&& width == h.width && height == h.height && real_size == h.real_size && max_depth == h.max_depth
+			&& light_sampling == h.light_sampling && texture_filtering == h.texture_filtering
+			&& pass_spp == h.pass_spp && adaptive_sampling == h.adaptive_sampling && min_spp == h.min_spp
+			&& max_spp == h.max_spp && batch == h.batch && max_error == h.max_error
+			&& luminance_floor == h.luminance_floor;
+	}
+};
+
+// Writes to a temporary file and renames it over path, so a job killed
+// mid-write still leaves the previous checkpoint intact.
+inline bool save_checkpoint(const std::string& path, const progressive_settings& settings, int passes,
+	const std::vector<pixel_estimator>& pixels)
+{
+	checkpoint_header header(settings);
+	header.passes = passes;
+
+	std::vector<pixel_estimator::state> states(pixels.size());
+	for (size_t p = 0; p < pixels.size(); p++)
+		states[p] = pixels[p].save();
+
+	std::string temp = path + ".tmp";
+	std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(states.data()), states.size() * sizeof(states[0]));
+	// Only a close that succeeds means the data reached the file.
+	out.close();
+	if (!out)
+	{
+		std::remove(temp.c_str());
+		return false;
+	}
+#ifdef _WIN32
+	// rename() does not replace an existing file on Windows.
+	std::remove(path.c_str());
+#endif
+	return std::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+// Restores pixels and the completed pass count from path. Fails, leaving
+// both untouched, if there is no checkpoint or it belongs to a render with
+// other settings or precision.
+inline bool load_checkpoint(const std::string& path, const progressive_settings& settings, int& passes,
+	std::vector<pixel_estimator>& pixels)
+{
+	std::ifstream in(path, std::ios::binary);
+	checkpoint_header expected(settings), header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || !expected.matches(header))
+		return false;
+
+	std::vector<pixel_estimator::state> states(size_t(settings.width) * settings.height);
+	if (!in.read(reinterpret_cast<char*>(states.data()), states.size() * sizeof(states[0])))
+		return false;
+	pixels.resize(states.size());
+	for (size_t p = 0; p < states.size(); p++)
+		pixels[p].restore(states[p]);
+	passes = header.passes;
+	return true;
+}
@@ -6,13 +6,38 @@ class ray
 public:
 	point3 orig;
 	vec3 dir;
-	double tm;
+	real tm;
+	// 1/dir and whether each component of dir is negative, for slab tests.
+	// An axis-parallel ray gets +-inf here, which the tests rely on.
+	vec3 inv_dir;
+	int sign[3];
+	// Ray cone used to filter textures: the width of the footprint at the
+	// origin and its growth per unit of distance. Zero when not tracked.
+	real cone_width = 0;
+	real cone_angle = 0;
 
 	ray(){}
-	ray(const point3& origin, const vec3& direction, double time = 0.0) :orig(origin), dir(direction), tm(time) {}
+	ray(const point3& origin, const vec3& direction, real time = 0.0) :orig(origin), dir(direction), tm(time),
+		inv_dir(1 / direction.x(), 1 / direction.y(), 1 / direction.z())
+	{
+		sign[0] = inv_dir.x() < 0;
+		sign[1] = inv_dir.y() < 0;
+		sign[2] = inv_dir.z() < 0;
+	}
 	point3 origin() const { return orig; }
 	vec3 direction() const { return dir; }
-	double time() const { return tm; }
-	point3 at(double t) const { return orig + dir * t; }
+	real time() const { return tm; }
+	point3 at(real t) const { return orig + dir * t; }
 
-};
\ No newline at end of file
+	// Width of the cone at parameter t.
+	real width_at(real t) const { return cone_angle > 0 ? cone_width + cone_angle * t * dir.length() : cone_width; }
+
+	// Continues the cone of parent from its hit, where it is width wide.
+	// Bounces do not widen it, so reflected detail stays sharp.
+	void continue_cone(const ray& parent, real width)
+	{
+		cone_width = width;
+		cone_angle = parent.cone_angle;
+	}
+
+};
@@ -0,0 +1,184 @@
+#pragma once
+#include "ray.h"
+
+// Up to width rays traced through the scene together, stored
+// structure-of-arrays. The tests that take a packet run each step over all
+// width lanes in a loop of fixed length, which the compiler turns into SIMD
+// code; lanes past size repeat lane 0 and are never in a mask. Bit i of a
+// lane mask stands for lane i.
+struct ray_packet
+{
+	static const int width = 8;
+
+	int size = 0;
+	alignas(32) real o[3][width];
+	alignas(32) real d[3][width];
+	alignas(32) real inv[3][width];	// 1/d, as ray::inv_dir
+	alignas(32) real t_max[width];	// closest hit so far, per lane
+	real time[width];
+	real t_min = 0.001;
+
+	// Set by finish() and bound_axis(): whether every lane has a finite 1/d
+	// of the same sign on each axis, and if so those signs and the ranges of
+	// the lanes' origins and 1/ds, which bound the whole packet in may_hit().
+	bool coherent = false;
+	bool axis_coherent[3] = { false, false, false };
+	int sign[3];
+	real o_lo[3], o_hi[3];
+	real inv_lo[3], inv_hi[3];
+
+	int all() const { return (1 << size) - 1; }
+
+	// mask as one flag per lane, 1 or 0, so lane loops can test it without
+	// shifts; and back from flags that are non-zero for the lanes to keep.
+	static void unpack(int mask, real* lanes)
+	{
+		for (int i = 0; i < width; i++)
+			lanes[i] = real((mask >> i) & 1);
+	}
+	static int pack(const real* lanes)
+	{
+		int mask = 0;
+		for (int i = 0; i < width; i++)
+			mask |= int(lanes[i] != 0) << i;
+		return mask;
+	}
+
+	void add(const ray& r, real t_max_ray = infinity)
+	{
+		int i = size++;
+		for (int a = 0; a < 3; a++)
+		{
+			o[a][i] = r.orig[a];
+			d[a][i] = r.dir[a];
+			inv[a][i] = r.inv_dir[a];
+		}
+		time[i] = r.tm;
+		t_max[i] = t_max_ray;
+	}
+
+	// Lane i as a single ray. 1/d is copied, not divided again, so it is
+	// exactly what the packet tests used.
+	ray get(int i) const
+	{
+		ray r;
+		for (int a = 0; a < 3; a++)
+		{
+			r.orig[a] = o[a][i];
+			r.dir[a] = d[a][i];
+			r.inv_dir[a] = inv[a][i];
+			r.sign[a] = inv[a][i] < 0;
+		}
+		r.tm = time[i];
+		return r;
+	}
+
+	// Pads the unused lanes and computes the shared signs and ranges, once
+	// all rays are added.
+	void finish()
+	{
+		for (int i = size; i < width; i++)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				o[a][i] = o[a][0];
+				d[a][i] = d[a][0];
+				inv[a][i] = inv[a][0];
+			}
+			time[i] = time[0];
+			t_max[i] = t_max[0];
+		}
+		for (int a = 0; a < 3; a++)
+			bound_axis(a);
+	}
+
+	// The ranges and sign of axis a, after its lanes changed. The padding
+	// repeats lane 0, so every lane can take part.
+	void bound_axis(int a)
+	{
+		real olo = o[a][0], ohi = o[a][0], ilo = inv[a][0], ihi = inv[a][0];
+		for (int i = 1; i < width; i++)
+		{
+			olo = o[a][i] < olo ? o[a][i] : olo;
+			ohi = o[a][i] > ohi ? o[a][i] : ohi;
+			ilo = inv[a][i] < ilo ? inv[a][i] : ilo;
+			ihi = inv[a][i] > ihi ? inv[a][i] : ihi;
+		}
+		o_lo[a] = olo;
+		o_hi[a] = ohi;
+		inv_lo[a] = ilo;
+		inv_hi[a] = ihi;
+		sign[a] = ilo < 0;
+		// An axis-parallel lane has 1/d of +-inf and no finite bound.
+		bool agree = (ilo < 0) == (ihi < 0) && fabs(ilo) < infinity && fabs(ihi) < infinity;
+		axis_coherent[a] = size > 0 && agree;
+		coherent = axis_coherent[0] && axis_coherent[1] && axis_coherent[2];
+	}
+
+	// False only if no lane of mask can enter the box within its segment.
+	// The slabs are taken over the ranges of origins and 1/ds with interval
+	// arithmetic: rounding is monotonic, so each corner bounds what every
+	// lane's own slab test computes, and a box this rejects box_mask()
+	// would too. Always true for a packet that is not coherent.
+	template <class T>
+	bool may_hit(const T* bmin, const T* bmax, int mask) const
+	{
+		if (!coherent)
+			return true;
+		real leave = t_min;
+		for (int i = 0; i < size; i++)
+		{
+			if ((mask >> i) & 1)
+				leave = t_max[i] > leave ? t_max[i] : leave;
+		}
+		real enter = t_min;
+		for (int a = 0; a < 3; a++)
+		{
+			real near_bound = sign[a] ? bmax[a] : bmin[a];
+			real far_bound = sign[a] ? bmin[a] : bmax[a];
+			// With a shared sign the nearest entry comes from the origin
+			// furthest along the axis, the furthest exit from the nearest.
+			real entry_lo = sign[a] ? o_lo[a] : o_hi[a];
+			real exit_hi = sign[a] ? o_hi[a] : o_lo[a];
+			real t0a = (near_bound - entry_lo) * inv_lo[a];
+			real t0b = (near_bound - entry_lo) * inv_hi[a];
+			real t1a = (far_bound - exit_hi) * inv_lo[a];
+			real t1b = (far_bound - exit_hi) * inv_hi[a];
+			real t0 = t0a < t0b ? t0a : t0b;
+			real t1 = t1a > t1b ? t1a : t1b;
+			enter = t0 > enter ? t0 : enter;
+			leave = t1 < leave ? t1 : leave;
+		}
+		return enter <= leave;
+	}
+
+	// The lanes of mask whose segment (t_min, t_max] overlaps the box, each
+	// with the slab test of linear_bvh::traverse. neg gives the sign of 1/d
+	// per axis, which every lane of mask must share.
+	template <class T>
+	int box_mask(const T* bmin, const T* bmax, const int neg[3], int mask) const
+	{
+		alignas(32) real tmin[width], tmax[width];
+		for (int i = 0; i < width; i++)
+		{
+			tmin[i] = t_min;
+			tmax[i] = t_max[i];
+		}
+		for (int a = 0; a < 3; a++)
+		{
+			real near_bound = neg[a] ? bmax[a] : bmin[a];
+			real far_bound = neg[a] ? bmin[a] : bmax[a];
+			for (int i = 0; i < width; i++)
+			{
+				real t0 = (near_bound - o[a][i]) * inv[a][i];
+				real t1 = (far_bound - o[a][i]) * inv[a][i];
+				tmin[i] = t0 > tmin[i] ? t0 : tmin[i];
+				tmax[i] = t1 < tmax[i] ? t1 : tmax[i];
+			}
+		}
+		int result = 0;
+		for (int i = 0; i < width; i++)
+			result |= int(tmin[i] <= tmax[i]) << i;
+		return result & mask;
+	}
+};
@@ -1,35 +1,93 @@
 #pragma once
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
-#include <random>
 
 using std::shared_ptr;
 using std::make_shared;
 using std::sqrt;
 
-const double infinity = std::numeric_limits<double>::infinity();
-const double pi = 3.1415926535897932385;
+// Scalar type for geometry, rays and colors. Define RT_USE_FLOAT to build the
+// renderer in single precision; statistics and the RNG stay in double.
+#ifdef RT_USE_FLOAT
+using real = float;
+#else
+using real = double;
+#endif
 
-inline double degrees_to_radians(double degrees)
+const real infinity = std::numeric_limits<real>::infinity();
+const real pi = real(3.1415926535897932385);
+
+inline real degrees_to_radians(real degrees)
 {
 	return degrees * pi / 180;
 }
+// PCG32 (O'Neill, pcg-random.org): 64-bit state, 32-bit output, one multiply
+// per draw and no locks.
+class pcg32
+{
+public:
+	pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+
+	void seed(uint64_t initstate, uint64_t initseq)
+	{
+		state = 0;
+		inc = (initseq << 1u) | 1u;
+		next();
+		state += initstate;
+		next();
+	}
+
+	uint32_t next()
+	{
+		uint64_t oldstate = state;
+		state = oldstate * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = static_cast<uint32_t>(((oldstate >> 18u) ^ oldstate) >> 27u);
+		uint32_t rot = static_cast<uint32_t>(oldstate >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+	}
+
+	// Uniform in [0, 1).
+	double next_double() { return next() * (1.0 / 4294967296.0); }
+
+private:
+	uint64_t state;
+	uint64_t inc;
+};
+
+inline uint64_t mix_bits(uint64_t v)
+{
+	// splitmix64 finalizer
+	v ^= v >> 30;
+	v *= 0xbf58476d1ce4e5b9ULL;
+	v ^= v >> 27;
+	v *= 0x94d049bb133111ebULL;
+	v ^= v >> 31;
+	return v;
+}
+
+// Each thread draws from its own generator, so render threads never share
+// state. The renderer reseeds it for every (pixel, sample) pair, which makes
+// a sample's random numbers independent of which thread traced it.
+inline pcg32& random_generator()
+{
+	thread_local pcg32 generator;
+	return generator;
+}
+inline void seed_random(uint64_t pixel, uint64_t sample = 0)
+{
+	random_generator().seed(mix_bits(pixel ^ mix_bits(sample)), pixel);
+}
 inline double random_double()
 {
-	return rand() / (RAND_MAX + 1.0);
+	return random_generator().next_double();
 }
 inline double random_double(double min, double max)
 {
 	return min + (max - min) * random_double();
 }
-//inline double random_double()
-//{
-//	static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-//	static std::mt19937 generator;
-//	return distribution(generator);
-//}
 inline double clamp(double x, double min, double max)
 {
 	if (x < min) return min;
@@ -0,0 +1,118 @@
+#pragma once
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A rectangle of image pixels [x0, x1) x [y0, y1), rows counted from the top.
+struct tile
+{
+	int x0, y0;
+	int x1, y1;
+};
+
+// Per-worker tile queue. The owner pops from the back, thieves take from the
+// front, so a stolen tile is the one the owner would have reached last.
+class tile_deque
+{
+public:
+	void push(const tile& t)
+	{
+		std::lock_guard<std::mutex> lock(m);
+		q.push_back(t);
+	}
+
+	bool pop(tile& t)
+	{
+		std::lock_guard<std::mutex> lock(m);
+		if (q.empty())
+			return false;
+		t = q.back();
+		q.pop_back();
+		return true;
+	}
+
+	bool steal(tile& t)
+	{
+		std::lock_guard<std::mutex> lock(m);
+		if (q.empty())
+			return false;
+		t = q.front();
+		q.pop_front();
+		return true;
+	}
+
+private:
+	std::mutex m;
+	std::deque<tile> q;
+};
+
+class tile_scheduler
+{
+public:
+	tile_scheduler(int width, int height, int tile_size = 16, int threads = 0)
+		: image_width(width), image_height(height), tile_size(tile_size)
+	{
+		if (threads <= 0)
+			threads = static_cast<int>(std::thread::hardware_concurrency());
+		thread_count = std::max(threads, 1);
+	}
+
+	int threads() const { return thread_count; }
+
+	// Calls render_tile(const tile&, int worker) once for every tile of the
+	// image, spread over the worker pool; worker, in [0, threads()), lets the
+	// caller keep scratch state per worker across tiles and runs. Tiles are
+	// dealt round-robin up front; a worker that runs dry steals from its
+	// neighbours. Returns once every tile is done.
+	template <class F>
+	void run(F render_tile) const
+	{
+		std::vector<tile_deque> deques(thread_count);
+
+		int n = 0;
+		for (int y = 0; y < image_height; y += tile_size)
+		{
+			for (int x = 0; x < image_width; x += tile_size)
+			{
+				tile t{ x, y, std::min(x + tile_size, image_width), std::min(y + tile_size, image_height) };
+				deques[n++ % thread_count].push(t);
+			}
+		}
+
+		auto worker = [&](int id)
+		{
+			tile t;
+			while (true)
+			{
+				if (!deques[id].pop(t) && !steal(deques, id, t))
+					return;
+				render_tile(t, id);
+			}
+		};
+
+		std::vector<std::thread> pool;
+		for (int id = 1; id < thread_count; id++)
+			pool.emplace_back(worker, id);
+		worker(0);
+		for (auto& th : pool)
+			th.join();
+	}
+
+private:
+	bool steal(std::vector<tile_deque>& deques, int id, tile& t) const
+	{
+		// No tiles are ever added after start-up, so one empty sweep means done.
+		for (int k = 1; k < thread_count; k++)
+		{
+			if (deques[(id + k) % thread_count].steal(t))
+				return true;
+		}
+		return false;
+	}
+
+	int image_width, image_height;
+	int tile_size;
+	int thread_count;
+};
@@ -1,58 +1,164 @@
 #pragma once
 #include "hittable.h"
+#include "material.h"
 #include "vec3.h"
 
+// Where the line o + t dir crosses a sphere of the given radius, with oc the
+// origin relative to the centre; false if the line misses or only touches
+// it. Shared by sphere and moving_sphere.
+//
+// b^2 - ac cancels badly when the ray starts far from a small sphere,
+// which float mode cannot afford. Measuring the squared distance from the
+// centre to the ray's closest point gives the same value without it.
+inline bool sphere_roots(const vec3& oc, const vec3& dir, real radius, real& near_t, real& far_t)
+{
+	auto a = dot(dir, dir);
+	auto half_b = dot(oc, dir);
+	vec3 l = oc - (half_b / a) * dir;
+	auto discriminator = a * (radius * radius - l.length_squared());
+	if (discriminator <= 0)
+		return false;
+	auto root = sqrt(discriminator);
+	near_t = (-half_b - root) / a;
+	far_t = (-half_b + root) / a;
+	return true;
+}
+
 class sphere : public hittable
 {
 public:
 	point3 center;
-	double radius;
+	real radius;
 	shared_ptr<material> mat_ptr;
 	sphere() {}
-	sphere(point3 cen, double r, shared_ptr<material> m) :center(cen), radius(r), mat_ptr(m) {}
-	virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
-	virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+	sphere(point3 cen, real r, shared_ptr<material> m) :center(cen), radius(r), mat_ptr(m) {}
+	virtual bool hit(const ray& r, real tmin, real tmax, hit_record& rec) const;
+	virtual bool hit_deferred(const ray& r, real tmin, real tmax, hit_record& rec) const;
+	virtual void complete(const ray& r, hit_record& rec) const;
+	virtual bool bounding_box(real t0, real t1, aabb& output_box) const;
+	virtual int hit_packet(ray_packet& p, int mask, packet_hits& hits) const;
+	virtual bool traces_packets() const { return true; }
+	virtual bool occluded(const ray& r, real t_min, real t_max) const;
+	virtual real pdf_value(const point3& o, const vec3& v) const;
+	virtual vec3 random(const point3& o) const;
+	virtual void collect_lights(light_collection& out) const
+	{
+		if (mat_ptr->type == material_type::diffuse_light)
+			out.lights.push_back(this);
+	}
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+template <> struct arena_allocatable<sphere> : std::true_type {};
+
+bool sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
-	vec3 oc = r.origin() - center;
-	auto a = dot(r.direction(), r.direction());
-	auto half_b = dot(oc, r.direction());
-	auto c = oc.length_squared() - radius * radius;
-	auto discriminator = half_b * half_b - a * c;
+	if (!hit_deferred(r, t_min, t_max, rec))
+		return false;
+	complete(r, rec);
+	rec.object = nullptr;
+	return true;
+}
 
-	if (discriminator > 0)
+// Finds the root only: the normal and get_sphere_uv's atan2/asin wait for
+// complete(), so candidates a closer hit replaces never pay for them.
+bool sphere::hit_deferred(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	real near_t, far_t;
+	if (!sphere_roots(r.origin() - center, r.direction(), radius, near_t, far_t))
+		return false;
+	auto t = near_t < t_max && near_t > t_min ? near_t : far_t;
+	if (!(t < t_max && t > t_min))
+		return false;
+	rec.t = t;
+	rec.object = this;
+	return true;
+}
+
+// sphere_roots() and hit_deferred()'s choice of root over every lane at once.
+int sphere::hit_packet(ray_packet& p, int mask, packet_hits& hits) const
+{
+	alignas(32) real lanes[ray_packet::width];
+	ray_packet::unpack(mask, lanes);
+	for (int i = 0; i < ray_packet::width; i++)
 	{
-		auto root = sqrt(discriminator);
-		auto temp = (-half_b - root) / a;
-		if (temp<t_max && temp>t_min)
-		{
-			rec.t = temp;
-			rec.p = r.at(temp);
-			vec3 outward_normal = (rec.p - center) / radius;
-			rec.set_face_normal(r, outward_normal);
-			get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
-			rec.mat_ptr = mat_ptr;
-			return true;
-		}
-		temp = (-half_b + root) / a;
-		if (temp<t_max && temp>t_min)
-		{
-			rec.t = temp;
-			rec.p = r.at(temp);
-			vec3 outward_normal = (rec.p - center) / radius;
-			rec.set_face_normal(r, outward_normal);
-			get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
-			rec.mat_ptr = mat_ptr;
-			return true;
-		}
+		real oc[3], l[3];
+		for (int a = 0; a < 3; a++)
+			oc[a] = p.o[a][i] - center[a];
+		auto a2 = p.d[0][i] * p.d[0][i] + p.d[1][i] * p.d[1][i] + p.d[2][i] * p.d[2][i];
+		auto half_b = oc[0] * p.d[0][i] + oc[1] * p.d[1][i] + oc[2] * p.d[2][i];
+		auto scale = half_b / a2;
+		for (int a = 0; a < 3; a++)
+			l[a] = oc[a] - scale * p.d[a][i];
+		auto discriminator = a2 * (radius * radius - (l[0] * l[0] + l[1] * l[1] + l[2] * l[2]));
+		auto root = sqrt(discriminator > 0 ? discriminator : 0);
+		auto near_t = (-half_b - root) / a2;
+		auto far_t = (-half_b + root) / a2;
+		auto t = near_t < p.t_max[i] && near_t > p.t_min ? near_t : far_t;
+		bool hit = (lanes[i] != 0) & (discriminator > 0) & (t < p.t_max[i]) & (t > p.t_min);
+		p.t_max[i] = hit ? t : p.t_max[i];
+		lanes[i] = hit ? 1 : 0;
 	}
-	return false;
+	return hits.lowered_by(this, ray_packet::pack(lanes));
 }
-bool sphere::bounding_box(double t0, double t1, aabb& output_box) const
+
+void sphere::complete(const ray& r, hit_record& rec) const
+{
+	rec.p = r.at(rec.t);
+	vec3 outward_normal = (rec.p - center) / radius;
+	rec.set_face_normal(r, outward_normal);
+	get_sphere_uv(outward_normal, rec.u, rec.v);
+	// v changes at 1/(pi r) per unit everywhere, u at 1/(2 pi r c) where c
+	// is the cosine of the latitude, so u's rate grows without bound towards
+	// the poles. c is floored to keep the scale finite at the poles.
+	auto c = fmax(sqrt(fmax(1 - outward_normal.y() * outward_normal.y(), 0.0)), 1e-3);
+	rec.uv_scale = 1 / (sqrt(2 * c) * pi * radius);
+	rec.mat_ptr = mat_ptr.get();
+}
+
+// Either root inside the interval counts; no record is filled.
+bool sphere::occluded(const ray& r, real t_min, real t_max) const
+{
+	real near_t, far_t;
+	if (!sphere_roots(r.origin() - center, r.direction(), radius, near_t, far_t))
+		return false;
+	return (near_t < t_max && near_t > t_min) || (far_t < t_max && far_t > t_min);
+}
+
+bool sphere::bounding_box(real t0, real t1, aabb& output_box) const
 {
 	output_box = aabb(center - vec3(radius, radius, radius),
 					  center + vec3(radius, radius, radius));
 	return true;
 }
+
+// Light sampling picks a direction uniformly inside the cone the sphere
+// subtends from o, so the density is one over the cone's solid angle. From
+// inside the sphere there is no cone and the sphere is never sampled.
+real sphere::pdf_value(const point3& o, const vec3& v) const
+{
+	hit_record rec;
+	auto distance_squared = (center - o).length_squared();
+	if (distance_squared <= radius * radius || !hit(ray(o, v), 0.001, infinity, rec))
+		return 0;
+	auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+	return 1 / (2 * pi * (1 - cos_theta_max));
+}
+
+vec3 sphere::random(const point3& o) const
+{
+	vec3 direction = center - o;
+	auto distance_squared = direction.length_squared();
+	if (distance_squared <= radius * radius)
+		return direction;
+	auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+	auto z = 1 + random_double() * (cos_theta_max - 1);
+	auto phi = 2 * pi * random_double();
+	auto r = sqrt(1 - z * z);
+
+	// An orthonormal basis around the axis towards the centre.
+	vec3 w = unit_vector(direction);
+	vec3 a = fabs(w.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+	vec3 t = unit_vector(cross(w, a));
+	vec3 s = cross(w, t);
+	return r * cos(phi) * s + r * sin(phi) * t + z * w;
+}
@@ -1,12 +1,16 @@
 #pragma once
 #include "rtweekend.h"
-#include "rtw_stb_image.h"
+#include "arena.h"
 #include <iostream>
 #include "perlin.h"
+#include "texture_cache.h"
 
 class texture {
 public:
-	virtual color value(double u, double v, const point3& p) const = 0;
+	virtual color value(real u, real v, const point3& p) const = 0;
+	// The average over a footprint width wide in (u, v), for textures that
+	// can filter; the rest return value().
+	virtual color filtered_value(real u, real v, const point3& p, real width) const { return value(u, v, p); }
 };
 
 class solid_color : public texture
@@ -15,9 +19,9 @@ public:
 	solid_color() {}
 	solid_color(color c) : color_value(c) {}
 
-	solid_color(double red, double green, double blue) :solid_color(color(red, green, blue)) {}
+	solid_color(real red, real green, real blue) :solid_color(color(red, green, blue)) {}
 
-	virtual color value(double u, double v, const point3& p) const {
+	virtual color value(real u, real v, const point3& p) const {
 		return color_value;
 	}
 private:
@@ -30,7 +34,7 @@ public:
 	checker_texture() {}
 	checker_texture(shared_ptr<texture> t0, shared_ptr<texture> t1) :even(t0), odd(t1) {}
 
-	virtual color value(double u, double v, const point3& p) const
+	virtual color value(real u, real v, const point3& p) const
 	{
 		auto sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
 		if (sines < 0)
@@ -50,12 +54,14 @@ public:
 	shared_ptr<texture> odd;
 };
 
+template <> struct arena_allocatable<checker_texture> : std::true_type {};
+
 class noise_texture :public texture
 {
 public:
 	noise_texture() {}
-	noise_texture(double sc) : scale(sc) {}
-	virtual color value(double u, double v, const point3& p) const
+	noise_texture(real sc) : scale(sc) {}
+	virtual color value(real u, real v, const point3& p) const
 	{
 		//Sec 5.4
 		//return color(1,1,1) * noise.noise(scale * p);
@@ -68,58 +74,29 @@ public:
 	}
 
 	perlin noise;
-	double scale;
+	real scale;
 };
 
+// An image from the texture_cache, stored as a tiled MIP pyramid (see
+// mip_pyramid) and looked up bilinearly, or trilinearly given a footprint.
+// Textures made from the same file share one cached image.
 class image_texture : public texture {
 public:
-	const static int bytes_per_pixel = 3;
-
-	image_texture()
-		: data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
-
-	image_texture(const char* filename) {
-		auto components_per_pixel = bytes_per_pixel;
+	image_texture() {}
 
-		data = stbi_load(
-			filename, &width, &height, &components_per_pixel, components_per_pixel);
-
-		if (!data) {
-			std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
-			width = height = 0;
-		}
-
-		bytes_per_scanline = bytes_per_pixel * width;
-	}
+	image_texture(const char* filename) : image(texture_cache::global().image(filename)) {}
 
-	~image_texture() {
-		delete data;
+	virtual color value(real u, real v, const vec3& p) const {
+		return filtered_value(u, v, p, 0);
 	}
 
-	virtual color value(double u, double v, const vec3& p) const {
+	virtual color filtered_value(real u, real v, const point3& p, real width) const {
 		// If we have no texture data, then return solid cyan as a debugging aid.
-		if (data == nullptr)
+		if (!image)
 			return color(0, 1, 1);
-
-		// Clamp input texture coordinates to [0,1] x [1,0]
-		u = clamp(u, 0.0, 1.0);
-		v = 1.0 - clamp(v, 0.0, 1.0);  // Flip V to image coordinates
-
-		auto i = static_cast<int>(u * width);
-		auto j = static_cast<int>(v * height);
-
-		// Clamp integer mapping, since actual coordinates should be less than 1.0
-		if (i >= width)  i = width - 1;
-		if (j >= height) j = height - 1;
-
-		const auto color_scale = 1.0 / 255.0;
-		auto pixel = data + j * bytes_per_scanline + i * bytes_per_pixel;
-
-		return color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
+		return image->trilinear(u, v, width);
 	}
 
 private:
-	unsigned char* data;
-	int width, height;
-	int bytes_per_scanline;
-};
\ No newline at end of file
+	std::shared_ptr<cached_image> image;
+};
@@ -0,0 +1,354 @@
+#pragma once
+#include "rtweekend.h"
+#include "mipmap.h"
+#include "texture_file.h"
+#include "thread_counters.h"
+#include "stb_image.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Texture lookups of one render; see thread_counters.
+struct texture_stats : thread_counters<texture_stats>
+{
+	long long hits = 0;		// texel reads from a resident page
+	long long misses = 0;	// reads that had to load their page first
+
+	void add(const texture_stats& other)
+	{
+		hits += other.hits;
+		misses += other.misses;
+	}
+};
+
+class texture_cache;
+
+// One image file in the cache: the layout of its MIP pyramid, and its texels
+// in pages of page_bytes that come and go under the cache's budget. While a
+// page is out its bytes wait in a spill file written once at load. A
+// texture file (see texture_file.h) is instead sampled straight from its
+// mapping and left to the operating system's paging.
+class cached_image
+{
+public:
+	static const size_t page_bytes = 64 * mip_pyramid::tile_bytes;	// 64 tiles, 16 KiB
+
+	cached_image(texture_cache& cache, mip_pyramid&& built, FILE* spill)
+		: cache(cache), pyramid(std::move(built)), spill(spill),
+		  page_count((pyramid.byte_size() + page_bytes - 1) / page_bytes), pages(new page[page_count]) {}
+
+	cached_image(texture_cache& cache, std::unique_ptr<mapped_texture_file> file)
+		: cache(cache), pyramid(file->texels()), spill(nullptr), page_count(0), file(std::move(file)) {}
+
+	~cached_image()
+	{
+		if (spill)
+			fclose(spill);
+	}
+
+	cached_image(const cached_image&) = delete;
+	cached_image& operator=(const cached_image&) = delete;
+
+	const mip_pyramid& layout() const { return pyramid; }
+
+	inline color trilinear(real u, real v, real width) const;
+
+private:
+	friend class texture_cache;
+
+	struct page
+	{
+		std::atomic<const unsigned char*> data{ nullptr };
+		std::atomic<bool> referenced{ false };	// for the cache's clock hand
+		std::unique_ptr<unsigned char[]> storage;	// owned by the cache, under its mutex
+	};
+
+	inline mip_pyramid::texel_value texel(size_t offset) const;
+
+	texture_cache& cache;
+	mip_pyramid pyramid;	// layout only; the texels are in the pages
+	FILE* spill;
+	size_t page_count;
+	std::unique_ptr<page[]> pages;
+	std::unique_ptr<mapped_texture_file> file;
+};
+
+// Process-wide cache of image textures. image() decodes each path once and
+// shares it between every texture made from that path; texels are paged in
+// on first use and the least recently used pages are dropped once the
+// resident texels pass the budget.
+//
+// Recency is tracked with a clock (second chance) over the resident pages:
+// a hit only sets the page's referenced bit, so lookups take no lock; a
+// miss takes the cache mutex to load the page and evict. Other threads may
+// still be reading an evicted page, so its memory is retired with the
+// current epoch and freed once every thread inside a lookup entered it in
+// a later epoch.
+class texture_cache
+{
+public:
+	static texture_cache& global()
+	{
+		static texture_cache cache;
+		return cache;
+	}
+
+	void set_budget(size_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(m);
+		budget = bytes;
+		evict_to_budget();
+		reclaim();
+	}
+
+	// The image at path, loaded on first request; null if it cannot be read.
+	std::shared_ptr<cached_image> image(const std::string& path)
+	{
+		std::lock_guard<std::mutex> lock(m);
+		requests++;
+		auto found = images.find(path);
+		if (found != images.end())
+			return found->second;
+
+		if (is_texture_file(path))
+		{
+			auto file = mapped_texture_file::open(path);
+			if (!file)
+			{
+				std::cerr << "ERROR: Could not map texture file '" << path << "'.\n";
+				return images[path] = nullptr;
+			}
+			return images[path] = std::make_shared<cached_image>(*this, std::move(file));
+		}
+
+		int width, height, components = 3;
+		auto data = stbi_load(path.c_str(), &width, &height, &components, 3);
+		if (!data)
+		{
+			std::cerr << "ERROR: Could not load texture image file '" << path << "'.\n";
+			return images[path] = nullptr;
+		}
+		mip_pyramid built(data, width, height);
+		stbi_image_free(data);
+
+		FILE* spill = tmpfile();
+		if (!spill || fwrite(built.data(), 1, built.byte_size(), spill) != built.byte_size())
+		{
+			std::cerr << "ERROR: Could not spill texture '" << path << "'.\n";
+			if (spill)
+				fclose(spill);
+			return images[path] = nullptr;
+		}
+		built.release_texels();
+		return images[path] = std::make_shared<cached_image>(*this, std::move(built), spill);
+	}
+
+	struct summary
+	{
+		size_t images = 0, mapped = 0, requests = 0;
+		size_t resident_bytes = 0, peak_bytes = 0, budget = 0;
+		long long evictions = 0;
+	};
+
+	summary stats() const
+	{
+		std::lock_guard<std::mutex> lock(m);
+		summary s;
+		for (const auto& image : images)
+		{
+			s.images += image.second != nullptr;
+			s.mapped += image.second && image.second->file;
+		}
+		s.requests = requests;
+		s.resident_bytes = resident_bytes;
+		s.peak_bytes = peak_bytes;
+		s.budget = budget;
+		s.evictions = evictions;
+		return s;
+	}
+
+private:
+	friend class cached_image;
+
+	texture_cache() {}
+
+	// A thread's lookup in progress: the epoch it started in, 0 when idle.
+	struct reader
+	{
+		std::atomic<uint64_t> pinned{ 0 };
+		bool in_use = false;	// under m
+	};
+
+	// Gives each thread a reader slot for its lifetime.
+	reader& local_reader()
+	{
+		struct slot
+		{
+			texture_cache& cache;
+			reader* r;
+			slot(texture_cache& cache) : cache(cache), r(cache.claim_reader()) {}
+			~slot()
+			{
+				std::lock_guard<std::mutex> lock(cache.m);
+				r->in_use = false;
+			}
+		};
+		thread_local slot s(*this);
+		return *s.r;
+	}
+
+	reader* claim_reader()
+	{
+		std::lock_guard<std::mutex> lock(m);
+		for (auto& r : readers)
+		{
+			if (!r.in_use)
+			{
+				r.in_use = true;
+				return &r;
+			}
+		}
+		readers.emplace_back();
+		readers.back().in_use = true;
+		return &readers.back();
+	}
+
+	// Frees the retired pages no reader can still hold: those retired before
+	// the epoch of every lookup now in progress.
+	void reclaim()
+	{
+		uint64_t oldest = UINT64_MAX;
+		for (const auto& r : readers)
+		{
+			auto e = r.pinned.load(std::memory_order_seq_cst);
+			if (e)
+				oldest = std::min(oldest, e);
+		}
+		size_t kept = 0;
+		for (auto& page : retired)
+		{
+			if (page.epoch >= oldest)
+				retired[kept++] = std::move(page);
+		}
+		retired.resize(kept);
+	}
+
+	// Loads page index of image unless another thread got there first.
+	const unsigned char* fault(cached_image& image, size_t index)
+	{
+		std::lock_guard<std::mutex> lock(m);
+		auto& p = image.pages[index];
+		if (auto data = p.data.load(std::memory_order_acquire))
+			return data;
+
+		size_t offset = index * cached_image::page_bytes;
+		size_t size = std::min(cached_image::page_bytes, image.pyramid.byte_size() - offset);
+		p.storage.reset(new unsigned char[cached_image::page_bytes]);
+#ifdef _WIN32
+		bool seeked = _fseeki64(image.spill, static_cast<long long>(offset), SEEK_SET) == 0;
+#else
+		bool seeked = fseeko(image.spill, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+		if (!seeked || fread(p.storage.get(), 1, size, image.spill) != size)
+			memset(p.storage.get(), 0, size);
+		p.referenced.store(true, std::memory_order_relaxed);
+		p.data.store(p.storage.get(), std::memory_order_release);
+
+		resident.push_back({ &image, index });
+		resident_bytes += cached_image::page_bytes;
+		peak_bytes = std::max(peak_bytes, resident_bytes);
+		evict_to_budget(&p);
+		reclaim();
+		return p.storage.get();
+	}
+
+	// Sweeps the clock hand until the resident pages fit, giving each
+	// referenced page a second chance. keep is never evicted.
+	void evict_to_budget(const cached_image::page* keep = nullptr)
+	{
+		size_t passes = 0;
+		while (resident_bytes > budget && resident.size() > 1 && passes < 2 * resident.size())
+		{
+			if (hand >= resident.size())
+				hand = 0;
+			auto& p = resident[hand].image->pages[resident[hand].index];
+			passes++;
+			if (&p == keep || p.referenced.exchange(false, std::memory_order_relaxed))
+			{
+				hand++;
+				continue;
+			}
+			p.data.store(nullptr, std::memory_order_seq_cst);
+			retired.push_back({ epoch.fetch_add(1, std::memory_order_seq_cst), std::move(p.storage) });
+			resident[hand] = resident.back();
+			resident.pop_back();
+			resident_bytes -= cached_image::page_bytes;
+			evictions++;
+			passes = 0;
+		}
+	}
+
+	struct resident_page
+	{
+		cached_image* image;
+		size_t index;
+	};
+
+	mutable std::mutex m;
+	std::map<std::string, std::shared_ptr<cached_image>> images;
+	std::vector<resident_page> resident;	// the clock
+	size_t hand = 0;
+	struct retired_page
+	{
+		uint64_t epoch;
+		std::unique_ptr<unsigned char[]> storage;
+	};
+	std::vector<retired_page> retired;
+	std::atomic<uint64_t> epoch{ 1 };
+	std::deque<reader> readers;		// never shrinks, so slots stay put
+	size_t budget = size_t(256) << 20;
+	size_t resident_bytes = 0, peak_bytes = 0;
+	size_t requests = 0;
+	long long evictions = 0;
+};
+
+// The lookup is pinned to the current epoch, so no page it reads is freed
+// under it.
+inline color cached_image::trilinear(real u, real v, real width) const
+{
+	if (file)
+		return file->texels().trilinear(u, v, width);
+	auto& r = cache.local_reader();
+	r.pinned.store(cache.epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+	auto c = pyramid.trilinear(u, v, width, [this](size_t offset) { return texel(offset); });
+	r.pinned.store(0, std::memory_order_release);
+	return c;
+}
+
+inline mip_pyramid::texel_value cached_image::texel(size_t offset) const
+{
+	auto& p = pages[offset / page_bytes];
+	auto data = p.data.load(std::memory_order_seq_cst);
+	if (data)
+	{
+		texture_stats::local().hits++;
+		if (!p.referenced.load(std::memory_order_relaxed))
+			p.referenced.store(true, std::memory_order_relaxed);
+	}
+	else
+	{
+		texture_stats::local().misses++;
+		data = cache.fault(const_cast<cached_image&>(*this), offset / page_bytes);
+	}
+	mip_pyramid::texel_value t;
+	memcpy(&t, data + offset % page_bytes, sizeof(t));
+	return t;
+}
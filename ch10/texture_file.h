@@ -0,0 +1,198 @@
+#pragma once
+#include "mipmap.h"
+#include "stb_image.h"
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Pre-decoded texture, written by `mian --make-tex in out`: this header, a
+// texture_file_level per MIP level, then at data_offset the tiled texels of
+// every level exactly as mip_pyramid keeps them. Loading maps the file
+// read-only and samples it in place, so nothing is decoded or copied and
+// render processes on one host share the pages.
+struct texture_file_header
+{
+	char magic[4] = { 'R', 'T', 'T', 'X' };
+	uint32_t version = 1;
+	uint32_t byte_order = 0x01020304;	// as written by the converting host
+	uint32_t level_count = 0;
+	uint64_t data_offset = 0;			// a multiple of texture_file_alignment
+	uint64_t data_bytes = 0;
+};
+
+struct texture_file_level
+{
+	uint32_t width, height;
+	uint32_t tiles_x;
+	uint32_t unused;
+	uint64_t offset;	// from data_offset
+};
+
+const size_t texture_file_alignment = 4096;
+
+inline bool is_texture_file(const std::string& path)
+{
+	texture_file_header expected, header;
+	std::ifstream in(path, std::ios::binary);
+	return in.read(reinterpret_cast<char*>(&header), sizeof(header))
+		&& memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0;
+}
+
+inline bool save_texture_file(const std::string& path, const mip_pyramid& pyramid)
+{
+	texture_file_header header;
+	header.level_count = pyramid.level_count();
+	size_t table_end = sizeof(header) + pyramid.level_count() * sizeof(texture_file_level);
+	header.data_offset = (table_end + texture_file_alignment - 1) / texture_file_alignment * texture_file_alignment;
+	header.data_bytes = pyramid.byte_size();
+
+	std::vector<texture_file_level> table;
+	for (const auto& l : pyramid.level_table())
+		table.push_back({ uint32_t(l.width), uint32_t(l.height), uint32_t(l.tiles_x), 0, l.offset });
+
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(table[0]));
+	std::vector<char> padding(header.data_offset - table_end);
+	out.write(padding.data(), padding.size());
+	out.write(reinterpret_cast<const char*>(pyramid.data()), pyramid.byte_size());
+	return bool(out);
+}
+
+// Decodes an image and writes it as a texture file.
+inline bool convert_texture(const std::string& in, const std::string& out)
+{
+	int width, height, components = 3;
+	auto data = stbi_load(in.c_str(), &width, &height, &components, 3);
+	if (!data)
+		return false;
+	mip_pyramid pyramid(data, width, height);
+	stbi_image_free(data);
+	return save_texture_file(out, pyramid);
+}
+
+// A texture file mapped read-only. Where mapping is not available (Windows,
+// or a failed mmap) the file is read into memory instead.
+class mapped_texture_file
+{
+public:
+	// Fails, returning null, if path is not a texture file this build can
+	// read or the file is cut short.
+	static std::unique_ptr<mapped_texture_file> open(const std::string& path)
+	{
+		std::unique_ptr<mapped_texture_file> file(new mapped_texture_file());
+		if (!file->map(path))
+			return nullptr;
+
+		texture_file_header expected, header;
+		if (file->size < sizeof(header))
+			return nullptr;
+		memcpy(&header, file->bytes, sizeof(header));
+		// Every bound is checked by subtraction, so a crafted header cannot
+		// wrap a sum past the end of the file.
+		if (memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version
+			|| header.byte_order != expected.byte_order || header.data_offset > file->size
+			|| header.data_bytes > file->size - header.data_offset
+			|| sizeof(header) + uint64_t(header.level_count) * sizeof(texture_file_level) > header.data_offset)
+			return nullptr;
+
+		// The levels must halve down to 1 x 1 as mip_pyramid builds them.
+		std::vector<mip_pyramid::level> levels;
+		for (uint32_t i = 0; i < header.level_count; i++)
+		{
+			texture_file_level l;
+			memcpy(&l, file->bytes + sizeof(header) + i * sizeof(l), sizeof(l));
+			if (levels.empty())
+			{
+				if (l.width == 0 || l.height == 0 || l.width > INT_MAX || l.height > INT_MAX)
+					return nullptr;
+			}
+			else
+			{
+				const auto& prev = levels.back();
+				if ((prev.width == 1 && prev.height == 1) || l.width != uint32_t(std::max(prev.width / 2, 1))
+					|| l.height != uint32_t(std::max(prev.height / 2, 1)))
+					return nullptr;
+			}
+			uint64_t tiles_y = (uint64_t(l.height) + mip_pyramid::tile_size - 1) / mip_pyramid::tile_size;
+			if (l.tiles_x != (uint64_t(l.width) + mip_pyramid::tile_size - 1) / mip_pyramid::tile_size
+				|| l.offset > header.data_bytes
+				|| l.tiles_x * tiles_y > (header.data_bytes - l.offset) / mip_pyramid::tile_bytes)
+				return nullptr;
+			levels.push_back({ int(l.width), int(l.height), int(l.tiles_x), size_t(l.offset) });
+		}
+		if (levels.empty() || levels.back().width != 1 || levels.back().height != 1)
+			return nullptr;
+		file->pyramid = mip_pyramid(std::move(levels), file->bytes + header.data_offset, header.data_bytes);
+		return file;
+	}
+
+	~mapped_texture_file()
+	{
+#ifndef _WIN32
+		if (mapped)
+			munmap(const_cast<unsigned char*>(bytes), size);
+#endif
+	}
+
+	mapped_texture_file(const mapped_texture_file&) = delete;
+	mapped_texture_file& operator=(const mapped_texture_file&) = delete;
+
+	// Samples the file's texels in place.
+	const mip_pyramid& texels() const { return pyramid; }
+
+private:
+	mapped_texture_file() {}
+
+	bool map(const std::string& path)
+	{
+#ifndef _WIN32
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED)
+			{
+				bytes = static_cast<const unsigned char*>(p);
+				size = size_t(st.st_size);
+				mapped = true;
+			}
+		}
+		close(fd);
+		if (mapped)
+			return true;
+#endif
+		std::ifstream in(path, std::ios::binary | std::ios::ate);
+		if (!in)
+			return false;
+		copy.resize(size_t(in.tellg()));
+		in.seekg(0);
+		if (!in.read(reinterpret_cast<char*>(copy.data()), copy.size()))
+			return false;
+		bytes = copy.data();
+		size = copy.size();
+		return true;
+	}
+
+	const unsigned char* bytes = nullptr;
+	size_t size = 0;
+	bool mapped = false;
+	std::vector<unsigned char> copy;
+	mip_pyramid pyramid;
+};
@@ -0,0 +1,26 @@
+#pragma once
+#include <mutex>
+
+// Counters for one render that every thread bumps without locking: each
+// thread counts into its own copy (Derived::local()) and folds it into the
+// shared total with collect_local(), e.g. once per tile. Derived declares
+// the counters and add(other), which sums other's into its own.
+template <class Derived>
+struct thread_counters
+{
+	static Derived& local()
+	{
+		thread_local Derived counters;
+		return counters;
+	}
+
+	// Adds the calling thread's counters to this total and clears them.
+	void collect_local()
+	{
+		static std::mutex m;
+		auto& l = local();
+		std::lock_guard<std::mutex> lock(m);
+		static_cast<Derived*>(this)->add(l);
+		l = Derived();
+	}
+};
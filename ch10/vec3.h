@@ -4,21 +4,102 @@
 #include<stdlib.h>
 #include<iostream>
 
+// With RT_USE_SIMD defined, vec3 keeps a zero fourth lane and does its
+// arithmetic with SSE (float builds) or AVX2 (double builds). Without it, or
+// when the target lacks the instructions, the scalar code below is used.
+#if defined(RT_USE_SIMD) && defined(RT_USE_FLOAT) && (defined(__SSE__) || defined(_M_X64))
+#define RT_VEC3_SIMD 1
+#include <xmmintrin.h>
+namespace simd
+{
+	using lanes = __m128;
+	inline lanes load(const float* p) { return _mm_load_ps(p); }
+	inline void store(float* p, lanes a) { _mm_store_ps(p, a); }
+	inline lanes splat(float t) { return _mm_set1_ps(t); }
+	inline lanes set(float x, float y, float z) { return _mm_set_ps(0, z, y, x); }
+	inline lanes add(lanes a, lanes b) { return _mm_add_ps(a, b); }
+	inline lanes sub(lanes a, lanes b) { return _mm_sub_ps(a, b); }
+	inline lanes mul(lanes a, lanes b) { return _mm_mul_ps(a, b); }
+	inline lanes yzx(lanes a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)); }
+	// x + y + z in the scalar order, so dot() rounds the same either way.
+	inline float sum3(lanes a)
+	{
+		lanes y = _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1));
+		return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(a, y), _mm_movehl_ps(a, a)));
+	}
+}
+#elif defined(RT_USE_SIMD) && !defined(RT_USE_FLOAT) && defined(__AVX2__)
+#define RT_VEC3_SIMD 1
+#include <immintrin.h>
+namespace simd
+{
+	using lanes = __m256d;
+	inline lanes load(const double* p) { return _mm256_load_pd(p); }
+	inline void store(double* p, lanes a) { _mm256_store_pd(p, a); }
+	inline lanes splat(double t) { return _mm256_set1_pd(t); }
+	inline lanes set(double x, double y, double z) { return _mm256_set_pd(0, z, y, x); }
+	inline lanes add(lanes a, lanes b) { return _mm256_add_pd(a, b); }
+	inline lanes sub(lanes a, lanes b) { return _mm256_sub_pd(a, b); }
+	inline lanes mul(lanes a, lanes b) { return _mm256_mul_pd(a, b); }
+	inline lanes yzx(lanes a) { return _mm256_permute4x64_pd(a, _MM_SHUFFLE(3, 0, 2, 1)); }
+	inline double sum3(lanes a)
+	{
+		__m128d xy = _mm256_castpd256_pd128(a);
+		__m128d zw = _mm256_extractf128_pd(a, 1);
+		return _mm_cvtsd_f64(_mm_add_sd(_mm_add_sd(xy, _mm_unpackhi_pd(xy, xy)), zw));
+	}
+}
+#endif
+
+#ifdef RT_VEC3_SIMD
+inline const char* vec3_backend() { return sizeof(real) == 4 ? "sse" : "avx2"; }
+#else
+inline const char* vec3_backend() { return "scalar"; }
+#endif
+
 class vec3
 {
 public:
-	double e[3];
+#ifdef RT_VEC3_SIMD
+	alignas(sizeof(simd::lanes)) real e[4];
+
+	// Filling all lanes with one vector store lets the next load forward from
+	// it; four scalar stores would stall that load.
+	vec3() { simd::store(e, simd::splat(0)); }
+	vec3(real e0, real e1, real e2) { simd::store(e, simd::set(e0, e1, e2)); }
+	explicit vec3(simd::lanes v) { simd::store(e, v); }
+	simd::lanes lanes() const { return simd::load(e); }
+#else
+	real e[3];
 
 	vec3() : e{0,0,0} {}
-	vec3(double e0, double e1, double e2) : e{e0,e1,e2} {}
+	vec3(real e0, real e1, real e2) : e{e0,e1,e2} {}
+#endif
 	
-	double x() const { return e[0]; }
-	double y() const { return e[1]; }
-	double z() const { return e[2]; }
+	real x() const { return e[0]; }
+	real y() const { return e[1]; }
+	real z() const { return e[2]; }
 
+	real operator[](int i) const { return e[i]; }
+	real& operator[](int i) { return e[i]; }
+
+#ifdef RT_VEC3_SIMD
+	vec3 operator-() const { return vec3(simd::mul(simd::splat(-1), lanes())); }
+
+	vec3& operator+=(const vec3& v)
+	{
+		simd::store(e, simd::add(lanes(), v.lanes()));
+		return *this;
+	}
+
+	vec3& operator*=(const real t)
+	{
+		simd::store(e, simd::mul(lanes(), simd::splat(t)));
+		return *this;
+	}
+	real length_squared() const { auto v = lanes(); return simd::sum3(simd::mul(v, v)); }
+#else
 	vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-	double operator[](int i) const { return e[i]; }
-	double& operator[](int i) { return e[i]; }
 
 	vec3& operator+=(const vec3& v)
 	{
@@ -28,22 +109,23 @@ public:
 		return *this;
 	}
 
-	vec3& operator*=(const double t)
+	vec3& operator*=(const real t)
 	{
 		e[0] *= t;
 		e[1] *= t;
 		e[2] *= t;
 		return *this;
 	}
-	vec3& operator/=(const double t) { return *this *= 1 / t; }
-	double length_squared() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
-	double length() const { return sqrt(length_squared()); }
+	real length_squared() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
+#endif
+	vec3& operator/=(const real t) { return *this *= 1 / t; }
+	real length() const { return sqrt(length_squared()); }
 
 	inline static vec3 random()
 	{
 		return vec3(random_double(), random_double(), random_double());
 	}
-	inline static vec3 random(double min, double max)
+	inline static vec3 random(real min, real max)
 	{
 		return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
 	}
@@ -55,6 +137,20 @@ inline std::ostream& operator<<(std::ostream& out, const vec3& v)
 {
 	return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
+#ifdef RT_VEC3_SIMD
+inline vec3 operator+(const vec3& u, const vec3& v) { return vec3(simd::add(u.lanes(), v.lanes())); }
+inline vec3 operator-(const vec3& u, const vec3& v) { return vec3(simd::sub(u.lanes(), v.lanes())); }
+inline vec3 operator*(const vec3& u, const vec3& v) { return vec3(simd::mul(u.lanes(), v.lanes())); }
+inline vec3 operator*(real t, const vec3& v) { return vec3(simd::mul(simd::splat(t), v.lanes())); }
+inline real dot(const vec3& u, const vec3& v) { return simd::sum3(simd::mul(u.lanes(), v.lanes())); }
+
+// u x v = (u * v.yzx - u.yzx * v).yzx; the zero fourth lanes stay zero.
+inline vec3 cross(const vec3& u, const vec3& v)
+{
+	auto a = u.lanes(), b = v.lanes();
+	return vec3(simd::yzx(simd::sub(simd::mul(a, simd::yzx(b)), simd::mul(simd::yzx(a), b))));
+}
+#else
 inline vec3 operator+(const vec3& u, const vec3& v)
 {
 	return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
@@ -68,19 +164,11 @@ inline vec3 operator*(const vec3& u, const vec3& v)
 {
 	return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
-inline vec3 operator*(double t, const vec3& v)
+inline vec3 operator*(real t, const vec3& v)
 {
 	return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
-inline vec3 operator*(const vec3& v, double t)
-{
-	return t * v;
-}
-inline vec3 operator/(vec3 v, double t)
-{
-	return (1 / t) * v;
-}
-inline float dot(const vec3& u, const vec3& v)
+inline real dot(const vec3& u, const vec3& v)
 {
 	return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
 }
@@ -90,6 +178,15 @@ inline vec3 cross(const vec3& u, const vec3& v)
 		-(u.e[0] * v.e[2] - v.e[0] * u.e[2]),
 		(u.e[0] * v.e[1] - v.e[0] * u.e[1]));
 }
+#endif
+inline vec3 operator*(const vec3& v, real t)
+{
+	return t * v;
+}
+inline vec3 operator/(vec3 v, real t)
+{
+	return (1 / t) * v;
+}
 inline vec3 unit_vector(vec3 v) { return v / v.length(); }
 
 vec3 random_in_unit_sphere()
@@ -120,7 +217,7 @@ vec3 reflect(const vec3& v, const vec3& n)
 {
 	return v - 2 * dot(v, n) * n;
 }
-vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat)
+vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat)
 {
 	auto cos_theta = dot(-uv, n);
 	vec3 r_out_parallel = etai_over_etat * (uv + cos_theta * n);
@@ -0,0 +1,215 @@
+#pragma once
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+#include "integrator.h"
+#include "adaptive.h"
+#include <vector>
+
+// Breadth-first alternative to ray_color_iterative. Every sample of a round
+// is a path whose state lives in the structure-of-arrays buffers below, and
+// the whole round advances one bounce at a time through separate stages:
+// generate camera rays, intersect, shade, and accumulate. Each path keeps its own random stream between stages and
+// draws from it in the same order as ray_color_iterative, so both produce
+// the same image.
+//
+// The stages are loops over paths, not SIMD lanes. intersect() is one
+// world.hit per path, through virtual calls and a traversal that diverges
+// per ray. shade_path() branches on each path's own random draws, which
+// must stay in depth-first order to keep the image identical. Hits are
+// shaded in the order they were found, through the vtable: shading them
+// grouped by material was tried and was slower, since their cost is the
+// textures and random draws, not the dispatch. Keep one renderer per
+// thread: its buffers grow to the largest round and are reused from then
+// on.
+class wavefront_renderer
+{
+public:
+	wavefront_renderer(const hittable& world, const color& background, int max_depth,
+		const light_list* lights = nullptr)
+		: world(world), background(background), max_depth(max_depth),
+		  lights(lights && !lights->empty() ? lights : nullptr) {}
+
+	// Traces every sample of spans and adds them to the spans' estimators.
+	// camera_ray(x, y, s) must seed the random stream of sample s and
+	// return its camera ray, as the depth-first renderer does.
+	template <class F>
+	void render(const std::vector<sample_span>& spans, F camera_ray)
+	{
+		generate(spans, camera_ray);
+		for (int bounce = 0; bounce < max_depth && !queue.empty(); bounce++)
+		{
+			intersect();
+			shade(bounce);
+		}
+		accumulate(spans);
+	}
+
+private:
+	template <class F>
+	void generate(const std::vector<sample_span>& spans, F camera_ray)
+	{
+		size_t n = 0;
+		for (const auto& span : spans)
+			n += span.last - span.first;
+		resize(n);
+
+		queue.clear();
+		int p = 0;
+		for (const auto& span : spans)
+		{
+			for (int s = span.first; s < span.last; s++, p++)
+			{
+				set_ray(p, camera_ray(span.x, span.y, s));
+				streams[p] = random_generator();
+				for (int c = 0; c < 3; c++)
+				{
+					throughput[c][p] = 1;
+					radiance[c][p] = 0;
+				}
+				scatter_pdf[p] = 0;
+				queue.push_back(p);
+			}
+		}
+	}
+
+	// Misses pick up the background and end; hits are kept for shade().
+	void intersect()
+	{
+		auto& stats = path_stats::local();
+		hits.clear();
+		for (int p : queue)
+		{
+			stats.segments++;
+			random_generator() = streams[p];
+			bool hit = world.hit(get_ray(p), 0.001, infinity, records[p]);
+			streams[p] = random_generator();
+			if (hit)
+			{
+				hits.push_back(p);
+				continue;
+			}
+			for (int c = 0; c < 3; c++)
+				radiance[c][p] += throughput[c][p] * background[c];
+		}
+	}
+
+	// Surviving paths form the next bounce's queue.
+	void shade(int bounce)
+	{
+		next.clear();
+		for (int p : hits)
+			shade_path(p, bounce);
+		queue.swap(next);
+	}
+
+	void shade_path(int p, int bounce)
+	{
+		const auto& rec = records[p];
+		ray current = get_ray(p);
+		random_generator() = streams[p];
+
+		auto emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+		if (scatter_pdf[p] > 0 && emitted.length_squared() > 0)
+			emitted *= emission_weight(*lights, current, rec, scatter_pdf[p]);
+		for (int c = 0; c < 3; c++)
+			radiance[c][p] += throughput[c][p] * emitted[c];
+
+		ray scattered;
+		color attenuation;
+		if (!rec.mat_ptr->scatter(current, rec, attenuation, scattered))
+			return;
+		scatter_pdf[p] = lights ? rec.mat_ptr->scattering_pdf(current, rec, scattered.direction()) : 0;
+		if (scatter_pdf[p] > 0)
+		{
+			auto direct = sample_light(*lights, world, current, rec);
+			for (int c = 0; c < 3; c++)
+				radiance[c][p] += throughput[c][p] * attenuation[c] * direct[c];
+		}
+		for (int c = 0; c < 3; c++)
+			throughput[c][p] *= attenuation[c];
+
+		if (bounce + 1 >= rr_start_depth)
+		{
+			auto survive = fmin(fmax(throughput[0][p], fmax(throughput[1][p], throughput[2][p])), 0.95);
+			if (random_double() >= survive)
+			{
+				path_stats::local().terminated++;
+				streams[p] = random_generator();
+				return;
+			}
+			// vec3::operator/= multiplies by the reciprocal; match it.
+			real scale = 1 / real(survive);
+			for (int c = 0; c < 3; c++)
+				throughput[c][p] *= scale;
+		}
+		set_ray(p, scattered);
+		streams[p] = random_generator();
+		next.push_back(p);
+	}
+
+	// Adds each path's radiance to its pixel in sample order.
+	void accumulate(const std::vector<sample_span>& spans)
+	{
+		int p = 0;
+		for (const auto& span : spans)
+		{
+			for (int s = span.first; s < span.last; s++, p++)
+				span.pixel->add(color(radiance[0][p], radiance[1][p], radiance[2][p]));
+		}
+	}
+
+	void resize(size_t n)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			origin[a].resize(n);
+			direction[a].resize(n);
+			throughput[a].resize(n);
+			radiance[a].resize(n);
+		}
+		time.resize(n);
+		cone_width.resize(n);
+		cone_angle.resize(n);
+		scatter_pdf.resize(n);
+		streams.resize(n);
+		records.resize(n);
+	}
+
+	void set_ray(int p, const ray& r)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			origin[a][p] = r.orig[a];
+			direction[a][p] = r.dir[a];
+		}
+		time[p] = r.tm;
+		cone_width[p] = r.cone_width;
+		cone_angle[p] = r.cone_angle;
+	}
+
+	ray get_ray(int p) const
+	{
+		ray r(point3(origin[0][p], origin[1][p], origin[2][p]),
+			vec3(direction[0][p], direction[1][p], direction[2][p]), time[p]);
+		r.cone_width = cone_width[p];
+		r.cone_angle = cone_angle[p];
+		return r;
+	}
+
+	const hittable& world;
+	color background;
+	int max_depth;
+	const light_list* lights;
+
+	// Path state, one entry per sample of the round.
+	std::vector<real> origin[3], direction[3], time;
+	std::vector<real> cone_width, cone_angle;
+	std::vector<real> throughput[3], radiance[3];
+	std::vector<real> scatter_pdf;	// as in ray_color_iterative
+	std::vector<pcg32> streams;
+	std::vector<hit_record> records;
+
+	std::vector<int> queue, next;	// live paths, this bounce and the next
+	std::vector<int> hits;			// paths of queue that hit something
+};